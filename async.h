@@ -0,0 +1,199 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "multiplexer.h"
+
+namespace streamlogger {
+
+// bounded lock-free multi-producer single-consumer queue (Vyukov-style sequenced slots)
+template<class T>
+class mpsc_queue {
+    struct slot {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::vector<slot> slots;
+    size_t mask;
+
+    alignas(64) std::atomic<size_t> enqueue_pos;
+    alignas(64) size_t dequeue_pos;
+
+    static size_t round_up(size_t v) {
+        size_t res = 2;
+        while(res < v) res <<= 1;
+        return res;
+    }
+
+public:
+    explicit mpsc_queue(size_t capacity): slots(round_up(capacity)), mask(slots.size() - 1), enqueue_pos(0), dequeue_pos(0) {
+        for(size_t i = 0; i < slots.size(); ++i) slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    mpsc_queue(const mpsc_queue&) = delete;
+
+    size_t capacity() const { return slots.size(); }
+
+    // fill is called with the reserved slot value and must not throw
+    template<class Fill>
+    bool try_push(Fill&& fill) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for(;;) {
+            slot& s = slots[pos & mask];
+            size_t seq = s.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if(diff == 0) {
+                if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    fill(s.value);
+                    s.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if(diff < 0) {
+                return false; // full
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // single consumer only
+    template<class Consume>
+    bool try_pop(Consume&& consume) {
+        slot& s = slots[dequeue_pos & mask];
+        size_t seq = s.sequence.load(std::memory_order_acquire);
+        if(static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(dequeue_pos + 1) < 0) return false;
+        consume(s.value);
+        s.sequence.store(dequeue_pos + mask + 1, std::memory_order_release);
+        ++dequeue_pos;
+        return true;
+    }
+};
+
+struct async_record {
+    std::shared_ptr<multiplexer> target;
+    message_info info;
+    std::string body;
+    std::string fields;
+    bool flush = false;
+};
+
+class async_dispatcher {
+public:
+    enum class overflow { BLOCK, DROP };
+
+private:
+    mpsc_queue<async_record> queue;
+    overflow overflow_;
+
+    std::atomic<size_t> pushed{0};
+    std::atomic<size_t> processed{0};
+    std::atomic<size_t> dropped_{0};
+
+    std::atomic<bool> done{false};
+    std::atomic<bool> sleeping{false};
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    std::thread worker;
+
+    void process(async_record& rec) {
+        rec.target->write(rec.info, rec.body, rec.fields);
+        if(rec.flush) rec.target->flush();
+
+        rec.target = nullptr;
+        rec.body.clear();
+        rec.fields.clear();
+    }
+
+    void run() {
+        for(;;) {
+            bool any = false;
+            while(queue.try_pop([this](async_record& rec) { process(rec); })) {
+                processed.fetch_add(1, std::memory_order_release);
+                any = true;
+            }
+            if(any) {
+                std::lock_guard<std::mutex> lock(wake_mutex);
+                drained.notify_all();
+                continue;
+            }
+            if(done.load(std::memory_order_acquire)) break;
+
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            sleeping.store(true, std::memory_order_seq_cst);
+            if(processed.load(std::memory_order_relaxed) == pushed.load(std::memory_order_seq_cst)) {
+                wake.wait_for(lock, std::chrono::milliseconds(10));
+            }
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    explicit async_dispatcher(size_t capacity = 8192, overflow policy = overflow::BLOCK):
+        queue(capacity), overflow_(policy), worker([this]{ run(); }) {}
+
+    async_dispatcher(const async_dispatcher&) = delete;
+
+    ~async_dispatcher() {
+        done.store(true, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            wake.notify_one();
+        }
+        worker.join();
+    }
+
+    // only honoured if set before the first call to instance()
+    static size_t& default_capacity() {
+        static size_t result = 8192;
+        return result;
+    }
+
+    static async_dispatcher& instance() {
+        static async_dispatcher result(default_capacity());
+        return result;
+    }
+
+    void set_overflow(overflow policy) { overflow_ = policy; }
+
+    void push(std::shared_ptr<multiplexer> target, const message_info& info, essentials::string_view body, essentials::string_view fields, bool flush) {
+        auto fill = [&](async_record& rec) {
+            rec.target = std::move(target);
+            rec.info = info;
+            rec.body.assign(body.data(), body.size());
+            rec.fields.assign(fields.data(), fields.size());
+            rec.flush = flush;
+        };
+        while(not queue.try_push(fill)) {
+            if(overflow_ == overflow::DROP) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            std::this_thread::yield();
+        }
+        pushed.fetch_add(1, std::memory_order_seq_cst);
+        if(sleeping.load(std::memory_order_seq_cst)) wake.notify_one();
+    }
+
+    // blocks until everything pushed before the call has reached the sinks
+    void drain() {
+        auto target = pushed.load(std::memory_order_acquire);
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        wake.notify_one();
+        drained.wait(lock, [&]{ return processed.load(std::memory_order_acquire) >= target; });
+    }
+
+    size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+};
+
+} /* namespace streamlogger */
+
+#endif // ASYNC_H
@@ -0,0 +1,251 @@
+#ifndef BINARY_LOG_H
+#define BINARY_LOG_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "buffer.h"
+
+namespace streamlogger {
+namespace binlog {
+
+// Binary log file layout (little-endian, as written by the host):
+//
+//   file    := magic chunk*
+//   magic   := "SLBLOG1\n"
+//   chunk   := u32 type, u32 payload size, u32 item count, u32 reserved, payload
+//   SITES   := site*
+//   site    := u32 id, u8 level, u8 arg count, u8 arg type * count, u32 line,
+//              str category, str format, str file, str function
+//   RECORDS := record*
+//   record  := u32 site id, u32 thread, u64 ns since the epoch, u32 args size, args
+//   str     := u32 size, bytes
+//
+// A site is always written before the first RECORDS chunk that refers to it, and
+// RECORDS chunks never depend on each other, so they can be decoded in parallel
+// once the SITES chunks have been read.
+
+static constexpr char magic[] = "SLBLOG1\n";
+static constexpr size_t magic_size = 8;
+
+// site ids are below this, so a reader can size its tables
+static constexpr std::uint32_t max_sites = 1 << 16;
+
+enum class chunk_type: std::uint32_t { SITES = 1, RECORDS = 2 };
+
+// Writers keep payloads below this; a reader takes a larger size for corruption
+// instead of allocating whatever the header says.
+static constexpr std::uint32_t max_chunk_size = 1 << 24;
+
+struct chunk_header {
+    std::uint32_t type;
+    std::uint32_t size;
+    std::uint32_t count;
+    std::uint32_t reserved;
+};
+
+static_assert(sizeof(chunk_header) == 16, "chunk_header is part of the file format");
+
+// Argument encodings; LITERAL (a pointer to a string that outlives the program's
+// logging) only exists in memory and is written to files as STRING.
+enum class arg_type: std::uint8_t {
+    INT,     // i64
+    UINT,    // u64
+    DOUBLE,  // f64
+    BOOL,    // u8
+    CHAR,    // u8
+    STRING,  // u32 size, bytes
+    POINTER, // u64
+    LITERAL  // const char*, u32 size
+};
+
+// the static part of a log statement
+struct site_info {
+    std::uint32_t id = 0;
+    level lvl = level::INFO;
+    std::uint32_t line = 0;
+    std::string category;
+    std::string format;
+    std::string file;
+    std::string function;
+    std::vector<arg_type> types;
+    // false when read from a file with unknown or in-memory-only argument types
+    bool valid = true;
+    // format split at every "{}": one more fragment than placeholders
+    std::vector<std::string> fragments;
+
+    void split_format() {
+        fragments.clear();
+        fragments.emplace_back();
+        for(size_t i = 0; i < format.size(); ++i) {
+            if(format[i] == '{' && i + 1 < format.size() && format[i + 1] == '}') {
+                fragments.emplace_back();
+                ++i;
+            } else fragments.back() += format[i];
+        }
+    }
+};
+
+template<class T>
+void put(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline void put_string(std::string& out, essentials::string_view sv) {
+    put(out, static_cast<std::uint32_t>(sv.size()));
+    out.append(sv.data(), sv.size());
+}
+
+// bounds-checked reads from a byte range; ok() turns false on the first overrun
+class reader {
+    const char* pos;
+    const char* end;
+    bool ok_ = true;
+
+public:
+    reader(const char* data, size_t size): pos(data), end(data + size) {}
+
+    bool ok() const { return ok_; }
+    bool done() const { return pos >= end; }
+    const char* where() const { return pos; }
+    size_t left() const { return static_cast<size_t>(end - pos); }
+
+    template<class T>
+    T get() {
+        T value{};
+        if(left() < sizeof(T)) {
+            ok_ = false;
+            pos = end;
+            return value;
+        }
+        std::memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+
+    essentials::string_view bytes(size_t size) {
+        if(left() < size) {
+            ok_ = false;
+            pos = end;
+            return {};
+        }
+        essentials::string_view res(pos, size);
+        pos += size;
+        return res;
+    }
+
+    essentials::string_view string() {
+        return bytes(get<std::uint32_t>());
+    }
+};
+
+inline void write_site(std::string& out, const site_info& site) {
+    put(out, site.id);
+    put(out, static_cast<std::uint8_t>(site.lvl));
+    put(out, static_cast<std::uint8_t>(site.types.size()));
+    for(auto t : site.types) put(out, static_cast<std::uint8_t>(t == arg_type::LITERAL ? arg_type::STRING : t));
+    put(out, site.line);
+    put_string(out, site.category);
+    put_string(out, site.format);
+    put_string(out, site.file);
+    put_string(out, site.function);
+}
+
+inline site_info read_site(reader& in) {
+    site_info site;
+    site.id = in.get<std::uint32_t>();
+    if(site.id >= max_sites) site.valid = false;
+    site.lvl = static_cast<level>(in.get<std::uint8_t>());
+    auto count = in.get<std::uint8_t>();
+    for(unsigned i = 0; i < count; ++i) {
+        auto type = in.get<std::uint8_t>();
+        // a LITERAL is a pointer into the writing process and must never be followed here
+        if(type > static_cast<std::uint8_t>(arg_type::POINTER)) site.valid = false;
+        site.types.push_back(static_cast<arg_type>(type));
+    }
+    site.line = in.get<std::uint32_t>();
+    site.category = std::string(in.string());
+    site.format = std::string(in.string());
+    site.file = std::string(in.string());
+    site.function = std::string(in.string());
+    site.split_format();
+    return site;
+}
+
+// Calls on_arg(type, in) for each argument; on_arg consumes exactly that argument.
+template<class F>
+bool for_each_arg(const site_info& site, reader& in, F on_arg) {
+    for(auto t : site.types) {
+        on_arg(t, in);
+        if(not in.ok()) return false;
+    }
+    return true;
+}
+
+// appends one argument as text
+inline void render_arg(arg_type type, reader& in, buffer& out) {
+    switch(type) {
+        case arg_type::INT: out.append_integer(in.get<std::int64_t>()); break;
+        case arg_type::UINT: out.append_integer(in.get<std::uint64_t>()); break;
+        case arg_type::DOUBLE: out.append_double(in.get<double>()); break;
+        case arg_type::BOOL: out.append_integer(in.get<std::uint8_t>()); break;
+        case arg_type::CHAR: out.append(in.get<char>()); break;
+        case arg_type::STRING: out.append(in.string()); break;
+        case arg_type::POINTER: out.append_pointer(reinterpret_cast<const void*>(static_cast<std::uintptr_t>(in.get<std::uint64_t>()))); break;
+        case arg_type::LITERAL: {
+            auto data = in.get<const char*>();
+            auto size = in.get<std::uint32_t>();
+            out.append(data, size);
+            break;
+        }
+    }
+}
+
+// renders the format with the encoded arguments substituted for its placeholders
+inline bool render(const site_info& site, reader& in, buffer& out) {
+    size_t i = 0;
+    bool ok = for_each_arg(site, in, [&](arg_type type, reader& r) {
+        if(i < site.fragments.size()) out.append(site.fragments[i]);
+        ++i;
+        render_arg(type, r, out);
+    });
+    for(; i < site.fragments.size(); ++i) out.append(site.fragments[i]);
+    return ok;
+}
+
+// copies the encoded arguments, turning in-memory LITERALs into STRINGs
+inline bool transcode_args(const site_info& site, reader& in, std::string& out) {
+    return for_each_arg(site, in, [&](arg_type type, reader& r) {
+        switch(type) {
+            case arg_type::INT:
+            case arg_type::UINT:
+            case arg_type::DOUBLE:
+            case arg_type::POINTER: {
+                auto bytes = r.bytes(8);
+                out.append(bytes.data(), bytes.size());
+                break;
+            }
+            case arg_type::BOOL:
+            case arg_type::CHAR:
+                out += r.get<char>();
+                break;
+            case arg_type::STRING:
+                put_string(out, r.string());
+                break;
+            case arg_type::LITERAL: {
+                auto data = r.get<const char*>();
+                auto size = r.get<std::uint32_t>();
+                put_string(out, essentials::string_view(data, size));
+                break;
+            }
+        }
+    });
+}
+
+} /* namespace binlog */
+} /* namespace streamlogger */
+
+#endif // BINARY_LOG_H
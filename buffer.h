@@ -0,0 +1,329 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "common.h"
+#include "escape.h"
+
+namespace streamlogger {
+
+// growable byte buffer usable as a streambuf; keeps its capacity between records
+class buffer: public std::streambuf {
+    std::string data_;
+    size_t reserved_at_ = 0;
+
+    static const char* digit_pairs() {
+        return "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+               "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+               "8081828384858687888990919293949596979899";
+    }
+
+    // writes v right-aligned into the characters before end, returns the start
+    static char* format_decimal(char* end, std::uint64_t v) {
+        while(v >= 100) {
+            auto pair = digit_pairs() + (v % 100) * 2;
+            v /= 100;
+            *--end = pair[1];
+            *--end = pair[0];
+        }
+        if(v >= 10) {
+            auto pair = digit_pairs() + v * 2;
+            *--end = pair[1];
+            *--end = pair[0];
+        } else *--end = static_cast<char>('0' + v);
+        return end;
+    }
+
+    void append_hex_byte(unsigned char ch) {
+        append("0123456789abcdef"[ch >> 4]);
+        append("0123456789abcdef"[ch & 0xf]);
+    }
+
+    // copies clean runs of sv in bulk; each special ASCII byte goes to escape_ascii,
+    // well-formed UTF-8 is copied and every other byte becomes U+FFFD. Stops before the
+    // escape or code point that would take the output past max_size bytes.
+    template<class Escape>
+    void append_escaped(essentials::string_view sv, escape::specials sp, Escape escape_ascii, size_t max_size) {
+        auto limit = data_.size() + std::min(max_size, data_.max_size() - data_.size());
+        auto data = sv.data();
+        auto size = sv.size();
+        while(size > 0) {
+            // clean bytes are single ASCII characters, so the run may be cut anywhere
+            auto run = std::min(escape::clean_run(data, size, sp), limit - data_.size());
+            append(data, run);
+            data += run;
+            size -= run;
+            if(size == 0 || data_.size() == limit) break;
+
+            auto mark = data_.size();
+            auto ch = static_cast<unsigned char>(*data);
+            size_t used = 1;
+            if(ch < 0x80) escape_ascii(ch);
+            else if((used = escape::utf8_sequence(data, size)) != 0) append(data, used);
+            else {
+                append(escape::replacement, 3);
+                used = 1;
+            }
+            if(data_.size() > limit) {
+                data_.resize(mark);
+                break;
+            }
+            data += used;
+            size -= used;
+        }
+    }
+
+    // Values between 1e-4 and 10^min_digits with a short exact decimal form (prices, ratios,
+    // whole numbers): the fewest fraction digits that read back as v, without snprintf.
+    // In that range %g would print the same text.
+    template<class F>
+    bool append_short_fixed(F v, int min_digits) {
+        static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+        double a = v < 0 ? -static_cast<double>(v) : static_cast<double>(v);
+        if(not (a >= 1e-4 && a < powers[min_digits])) return false;
+
+        for(int d = 0; d < 16; ++d) {
+            double scaled = a * powers[d];
+            // up to min_digits digits the decimal that reads back as v is unique
+            if(scaled >= powers[min_digits]) return false;
+            auto m = static_cast<std::uint64_t>(scaled + 0.5);
+            if(static_cast<F>(static_cast<double>(m) / powers[d]) != static_cast<F>(a)) continue;
+
+            char digits[48];
+            auto end = digits + sizeof(digits);
+            auto begin = end;
+            for(int i = 0; i < d; ++i) {
+                *--begin = static_cast<char>('0' + m % 10);
+                m /= 10;
+            }
+            if(d > 0) *--begin = '.';
+            begin = format_decimal(begin, m);
+            if(v < 0) *--begin = '-';
+            append(begin, static_cast<size_t>(end - begin));
+            return true;
+        }
+        return false;
+    }
+
+    // shortest of %.{min}g..%.{max}g that reads back as the same value
+    template<class F>
+    void append_floating(F v, int min_digits, int max_digits) {
+        if(append_short_fixed(v, min_digits)) return;
+        char tmp[40];
+        int size = 0;
+        for(int digits = min_digits; digits <= max_digits; ++digits) {
+            size = std::snprintf(tmp, sizeof(tmp), "%.*g", digits, static_cast<double>(v));
+            if(v != v || static_cast<F>(std::strtod(tmp, nullptr)) == v) break;
+        }
+        append(tmp, static_cast<size_t>(size));
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        if(not traits_type::eq_int_type(ch, traits_type::eof())) data_.push_back(traits_type::to_char_type(ch));
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char_type* s, std::streamsize n) override {
+        data_.append(s, static_cast<size_t>(n));
+        return n;
+    }
+
+public:
+    buffer() = default;
+    buffer(const buffer&) = delete;
+
+    void append(const char* data, size_t size) { data_.append(data, size); }
+    void append(essentials::string_view sv) { data_.append(sv.data(), sv.size()); }
+    void append(char ch) { data_.push_back(ch); }
+    void append(size_t count, char ch) { data_.append(count, ch); }
+    void insert(size_t pos, size_t count, char ch) { data_.insert(pos, count, ch); }
+
+    // room for up to size bytes, to be followed by commit() with the number actually used
+    char* reserve(size_t size) {
+        reserved_at_ = data_.size();
+        data_.resize(reserved_at_ + size);
+        return &data_[reserved_at_];
+    }
+
+    void commit(size_t used) { data_.resize(reserved_at_ + used); }
+
+    template<class T>
+    std::enable_if_t<std::is_integral<T>::value && std::is_unsigned<T>::value> append_integer(T v) {
+        char digits[24];
+        auto end = digits + sizeof(digits);
+        auto begin = format_decimal(end, v);
+        append(begin, static_cast<size_t>(end - begin));
+    }
+
+    template<class T>
+    std::enable_if_t<std::is_integral<T>::value && std::is_signed<T>::value> append_integer(T v) {
+        char digits[24];
+        auto end = digits + sizeof(digits);
+        // negate in unsigned arithmetic so that the minimum value does not overflow
+        auto magnitude = v < 0 ? 0 - static_cast<std::uint64_t>(v) : static_cast<std::uint64_t>(v);
+        auto begin = format_decimal(end, magnitude);
+        if(v < 0) *--begin = '-';
+        append(begin, static_cast<size_t>(end - begin));
+    }
+
+    // shortest text that strtod reads back as the same value
+    void append_double(double v) { append_floating(v, 15, 17); }
+    void append_float(float v) { append_floating(v, 6, 9); }
+
+    // as std::ostream prints a void*: hexadecimal with 0x, or 0 for null
+    void append_pointer(const void* p) {
+        auto v = reinterpret_cast<std::uintptr_t>(p);
+        if(v == 0) {
+            append('0');
+            return;
+        }
+        char digits[24];
+        auto end = digits + sizeof(digits);
+        auto begin = end;
+        while(v != 0) {
+            *--begin = "0123456789abcdef"[v & 0xf];
+            v >>= 4;
+        }
+        *--begin = 'x';
+        *--begin = '0';
+        append(begin, static_cast<size_t>(end - begin));
+    }
+
+    // sv as the contents of a JSON string: quotes, backslashes and control characters
+    // escaped, ill-formed UTF-8 replaced by U+FFFD, everything else copied as is
+    void append_json_escaped(essentials::string_view sv, size_t max_size = ~size_t(0)) {
+        append_escaped(sv, escape::json, [this](unsigned char ch) {
+            append('\\');
+            switch(ch) {
+                case '"': append('"'); break;
+                case '\\': append('\\'); break;
+                case '\n': append('n'); break;
+                case '\r': append('r'); break;
+                case '\t': append('t'); break;
+                default:
+                    append("u00", 3);
+                    append_hex_byte(ch);
+                    break;
+            }
+        }, max_size);
+    }
+
+    // sv with control characters written as \n, \r, \t or \xNN and ill-formed UTF-8 replaced
+    // by U+FFFD, so that it cannot break a line-oriented log apart; at most max_size bytes
+    void append_sanitized(essentials::string_view sv, size_t max_size = ~size_t(0)) {
+        append_escaped(sv, escape::text, [this](unsigned char ch) {
+            append('\\');
+            switch(ch) {
+                case '\n': append('n'); break;
+                case '\r': append('r'); break;
+                case '\t': append('t'); break;
+                default:
+                    append('x');
+                    append_hex_byte(ch);
+                    break;
+            }
+        }, max_size);
+    }
+
+    const char* data() const { return data_.data(); }
+    size_t size() const { return data_.size(); }
+    size_t capacity() const { return data_.capacity(); }
+    bool empty() const { return data_.empty(); }
+    essentials::string_view view() const { return essentials::string_view(data_.data(), data_.size()); }
+    const std::string& str() const { return data_; }
+
+    void clear() { data_.clear(); }
+};
+
+class buffer_stream: public std::ostream {
+    buffer buf_;
+
+    struct pool {
+        std::vector<buffer_stream*> free;
+        ~pool();
+    };
+
+    // stays readable after the thread_local pool is destroyed
+    static bool& pool_dead() {
+        static thread_local bool result = false;
+        return result;
+    }
+
+    static pool& local_pool() {
+        static thread_local pool result;
+        return result;
+    }
+
+    static constexpr size_t max_pooled = 16;
+    static constexpr size_t max_pooled_capacity = 1 << 16;
+
+public:
+    buffer_stream(): std::ostream(&buf_) {}
+    buffer_stream(const buffer_stream&) = delete;
+
+    buffer& buf() { return buf_; }
+    const buffer& buf() const { return buf_; }
+    essentials::string_view view() const { return buf_.view(); }
+
+    // no flags, width or precision changed by manipulators since reset()
+    bool plain() const {
+        return flags() == (std::ios_base::dec | std::ios_base::skipws) && width() == 0 && precision() == 6;
+    }
+
+    void reset() {
+        buf_.clear();
+        std::ostream::clear();
+        flags(std::ios_base::dec | std::ios_base::skipws);
+        width(0);
+        precision(6);
+        fill(' ');
+    }
+
+    struct release {
+        void operator()(buffer_stream* bs) const {
+            if(pool_dead() || bs->buf_.capacity() > max_pooled_capacity) {
+                delete bs;
+                return;
+            }
+            auto&& free = local_pool().free;
+            if(free.size() >= max_pooled) delete bs;
+            else free.push_back(bs);
+        }
+    };
+
+    using ptr = std::unique_ptr<buffer_stream, release>;
+
+    // a cleared buffer from the calling thread's pool
+    static ptr acquire() {
+        if(not pool_dead()) {
+            auto&& free = local_pool().free;
+            if(not free.empty()) {
+                ptr res{ free.back() };
+                free.pop_back();
+                res->reset();
+                return res;
+            }
+        }
+        return ptr{ new buffer_stream() };
+    }
+};
+
+inline buffer_stream::pool::~pool() {
+    pool_dead() = true;
+    for(auto&& bs : free) delete bs;
+}
+
+} /* namespace streamlogger */
+
+#endif // BUFFER_H
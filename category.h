@@ -5,33 +5,196 @@
 #include "multiplexer.h"
 #include "logger.h"
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 namespace streamlogger {
 
 class category {
     std::string name_;
-    std::shared_ptr<multiplexer> multiplexer_;
+    const char* interned_name_;
+    // Never modified once published: changes build a new multiplexer and store it here,
+    // so loggers on other threads see either the old or the new one. Readers take no
+    // lock; replaced multiplexers are retired, never freed (see multiplexer::retire).
+    std::atomic<multiplexer*> multiplexer_;
+    // the category's reference to the multiplexer in multiplexer_
+    std::shared_ptr<multiplexer> published_;
+    // the single comparison made by enabled()
+    std::atomic<level> min_level_;
+
+    // writers only, under update_mutex_
+    std::mutex update_mutex_;
+    // the category's own level
+    level threshold_ = level::ALL;
+    // lowest level accepted by any formatter; above FATAL while there are none
+    level formatter_min_ = no_formatters();
+
+    static level no_formatters() { return static_cast<level>(static_cast<int>(level::FATAL) + 1); }
+
+    std::shared_ptr<multiplexer> current() const {
+        for(;;) {
+            // fails only if published_ moved on after the load, so the next load is newer
+            if(auto res = multiplexer_.load(std::memory_order_acquire)->lock()) return res;
+        }
+    }
+
+    // update_mutex_ must be held
+    void publish(std::shared_ptr<multiplexer> next) {
+        multiplexer_.store(next.get(), std::memory_order_release);
+        published_ = std::move(next);
+        min_level_.store(std::max(threshold_, formatter_min_), std::memory_order_release);
+    }
+
+    template<level L>
+    streamlogger::logger make_logger(std::true_type) { return logger(L); }
+    template<level L>
+    null_logger make_logger(std::false_type) { return {}; }
 public:
-    explicit category(const std::string& name): name_(name), multiplexer_(new multiplexer()) {}
+    explicit category(const std::string& name):
+        name_(name),
+        interned_name_(util::intern(name)),
+        published_(multiplexer::create({})),
+        min_level_(no_formatters()) {
+        multiplexer_.store(published_.get(), std::memory_order_release);
+    }
+
+    category(const category&) = delete;
 
     void add_sink(std::shared_ptr<sink> out, const std::string& pattern, level threshold = level::ALL) {
-        auto form = std::make_shared<formatter>(out, pattern, threshold);
-        multiplexer_->formatters.push_back(form);
+        add_formatter(std::make_shared<formatter>(out, pattern, threshold));
     }
 
+    void add_formatter(std::shared_ptr<formatter> form) {
+        std::lock_guard<std::mutex> lock(update_mutex_);
+        auto next = multiplexer::create(multiplexer(*published_));
+        formatter_min_ = std::min(formatter_min_, form->get_threshold());
+        next->formatters.push_back(std::move(form));
+        publish(std::move(next));
+    }
+
+    // records below lvl are dropped before reaching any formatter
+    void set_level(level lvl) {
+        std::lock_guard<std::mutex> lock(update_mutex_);
+        threshold_ = lvl;
+        publish(published_);
+    }
+
+    const std::string& name() const { return name_; }
+
+    // Replaces level, formatters and async mode in one step; used when the registry is
+    // reconfigured. Records logged meanwhile go to either the old or the new formatters.
+    void reconfigure(level lvl, std::vector<std::shared_ptr<formatter>> formatters, bool async) {
+        std::lock_guard<std::mutex> lock(update_mutex_);
+        multiplexer next;
+        formatter_min_ = no_formatters();
+        for(auto&& form : formatters) formatter_min_ = std::min(formatter_min_, form->get_threshold());
+        next.formatters = std::move(formatters);
+        next.async_ = async ? &async_dispatcher::instance() : nullptr;
+        threshold_ = lvl;
+        publish(multiplexer::create(std::move(next)));
+    }
+
+    // drops all sinks
+    void reset() {
+        reconfigure(level::ALL, {}, false);
+    }
+
+    // write to the same formatters as that, at the same level
+    void inherit(category& that) {
+        std::lock(update_mutex_, that.update_mutex_);
+        std::lock_guard<std::mutex> lock(update_mutex_, std::adopt_lock);
+        std::lock_guard<std::mutex> that_lock(that.update_mutex_, std::adopt_lock);
+        threshold_ = that.threshold_;
+        formatter_min_ = that.formatter_min_;
+        publish(that.published_);
+    }
+
+    bool enabled(level level_) const {
+        return level_ >= min_level_.load(std::memory_order_relaxed);
+    }
+
+    // hand records to async_dispatcher::instance() instead of writing on the calling thread
+    void set_async(bool enabled) {
+        std::lock_guard<std::mutex> lock(update_mutex_);
+        auto next = multiplexer::create(multiplexer(*published_));
+        next->async_ = enabled ? &async_dispatcher::instance() : nullptr;
+        publish(std::move(next));
+    }
+
+    // hands an already rendered body to the formatters, bypassing the logger
+    void write(const message_info& mi, essentials::string_view body, essentials::string_view fields = {}) {
+        current()->write(mi, body, fields);
+    }
+
+    // a null logger if nothing would be written at this level
     streamlogger::logger logger(level level_) {
-        return streamlogger::logger{ name_, level_, multiplexer_, nullptr, nullptr };
+        return streamlogger::logger{ interned_name_, level_, enabled(level_) ? current() : nullptr, nullptr, nullptr };
+    }
+
+    streamlogger::logger logger(level level_, const char* caller, const location& loc) {
+        return streamlogger::logger{ interned_name_, level_, enabled(level_) ? current() : nullptr, caller, &loc };
     }
 
-    streamlogger::logger trace() { return logger(level::TRACE); }
-    streamlogger::logger debug() { return logger(level::DEBUG); }
-    streamlogger::logger info()  { return logger(level::INFO);  }
-    streamlogger::logger warn()  { return logger(level::WARN);  }
-    streamlogger::logger error() { return logger(level::ERROR); }
-    streamlogger::logger fatal() { return logger(level::FATAL); }
+    // null_logger if L is below STREAMLOGGER_MIN_LEVEL
+    template<level L>
+    level_logger<L> log() { return make_logger<L>(level_enabled<L>{}); }
+
+    level_logger<level::TRACE> trace() { return log<level::TRACE>(); }
+    level_logger<level::DEBUG> debug() { return log<level::DEBUG>(); }
+    level_logger<level::INFO>  info()  { return log<level::INFO>();  }
+    level_logger<level::WARN>  warn()  { return log<level::WARN>();  }
+    level_logger<level::ERROR> error() { return log<level::ERROR>(); }
+    level_logger<level::FATAL> fatal() { return log<level::FATAL>(); }
 };
 
 } /* namespace streamlogger */
 
+// Streamed arguments are only evaluated if CATEGORY (an lvalue) is enabled for LEVEL:
+//     STREAMLOGGER_LOG(cat, level::DEBUG) << expensive();
+#define STREAMLOGGER_LOG(CATEGORY, LEVEL) \
+    for(auto& sl_category_ = (CATEGORY), *sl_once_ = &sl_category_; \
+        ::streamlogger::compiled_in(LEVEL) && sl_once_ && sl_category_.enabled(LEVEL); \
+        sl_once_ = nullptr) \
+        sl_category_.logger((LEVEL), __func__, ::streamlogger::location{ __FILE__, __LINE__ })
+
+// statements below STREAMLOGGER_MIN_LEVEL are still type-checked, but never emitted
+#define STREAMLOGGER_STRIPPED(CATEGORY) \
+    if(true) ; else ::streamlogger::null_logger{}
+
+#if STREAMLOGGER_MIN_LEVEL <= STREAMLOGGER_LEVEL_TRACE
+#define STREAMLOGGER_TRACE(CATEGORY) STREAMLOGGER_LOG(CATEGORY, ::streamlogger::level::TRACE)
+#else
+#define STREAMLOGGER_TRACE(CATEGORY) STREAMLOGGER_STRIPPED(CATEGORY)
+#endif
+
+#if STREAMLOGGER_MIN_LEVEL <= STREAMLOGGER_LEVEL_DEBUG
+#define STREAMLOGGER_DEBUG(CATEGORY) STREAMLOGGER_LOG(CATEGORY, ::streamlogger::level::DEBUG)
+#else
+#define STREAMLOGGER_DEBUG(CATEGORY) STREAMLOGGER_STRIPPED(CATEGORY)
+#endif
+
+#if STREAMLOGGER_MIN_LEVEL <= STREAMLOGGER_LEVEL_INFO
+#define STREAMLOGGER_INFO(CATEGORY) STREAMLOGGER_LOG(CATEGORY, ::streamlogger::level::INFO)
+#else
+#define STREAMLOGGER_INFO(CATEGORY) STREAMLOGGER_STRIPPED(CATEGORY)
+#endif
+
+#if STREAMLOGGER_MIN_LEVEL <= STREAMLOGGER_LEVEL_WARN
+#define STREAMLOGGER_WARN(CATEGORY) STREAMLOGGER_LOG(CATEGORY, ::streamlogger::level::WARN)
+#else
+#define STREAMLOGGER_WARN(CATEGORY) STREAMLOGGER_STRIPPED(CATEGORY)
+#endif
+
+#if STREAMLOGGER_MIN_LEVEL <= STREAMLOGGER_LEVEL_ERROR
+#define STREAMLOGGER_ERROR(CATEGORY) STREAMLOGGER_LOG(CATEGORY, ::streamlogger::level::ERROR)
+#else
+#define STREAMLOGGER_ERROR(CATEGORY) STREAMLOGGER_STRIPPED(CATEGORY)
+#endif
+
+#define STREAMLOGGER_FATAL(CATEGORY) STREAMLOGGER_LOG(CATEGORY, ::streamlogger::level::FATAL)
+
 #endif // CATEGORY_H
@@ -5,48 +5,87 @@
 #include <ctime>
 #include <cmath>
 #include <chrono>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "lib/string_view/string_view.hpp"
 
+#define STREAMLOGGER_LEVEL_ALL   0
+#define STREAMLOGGER_LEVEL_TRACE 1
+#define STREAMLOGGER_LEVEL_DEBUG 2
+#define STREAMLOGGER_LEVEL_INFO  3
+#define STREAMLOGGER_LEVEL_WARN  4
+#define STREAMLOGGER_LEVEL_ERROR 5
+#define STREAMLOGGER_LEVEL_FATAL 6
+
+// statements below this level are compiled out, e.g. -DSTREAMLOGGER_MIN_LEVEL=STREAMLOGGER_LEVEL_INFO
+#ifndef STREAMLOGGER_MIN_LEVEL
+#define STREAMLOGGER_MIN_LEVEL STREAMLOGGER_LEVEL_ALL
+#endif
+
 namespace streamlogger {
 
-enum class level {
-    ALL,
-    TRACE,
-    DEBUG,
-    INFO,
-    WARN,
-    ERROR,
-    FATAL
+enum class level: std::uint8_t {
+    ALL = STREAMLOGGER_LEVEL_ALL,
+    TRACE = STREAMLOGGER_LEVEL_TRACE,
+    DEBUG = STREAMLOGGER_LEVEL_DEBUG,
+    INFO = STREAMLOGGER_LEVEL_INFO,
+    WARN = STREAMLOGGER_LEVEL_WARN,
+    ERROR = STREAMLOGGER_LEVEL_ERROR,
+    FATAL = STREAMLOGGER_LEVEL_FATAL
+};
+
+// with the default minimum there is nothing to compare: a level is never below 0, and
+// saying so would trip -Wtype-limits
+constexpr bool compiled_in(level lvl) {
+#if STREAMLOGGER_MIN_LEVEL <= STREAMLOGGER_LEVEL_ALL
+    return static_cast<void>(lvl), true;
+#else
+    return static_cast<int>(lvl) >= STREAMLOGGER_MIN_LEVEL;
+#endif
+}
+
+template<level L>
+struct level_enabled: std::integral_constant<bool, compiled_in(L)> {};
+
+enum class clock_source: std::uint8_t {
+    REALTIME,        // std::chrono::system_clock
+    REALTIME_COARSE, // CLOCK_REALTIME_COARSE: tick-granular; still a vDSO call, but it skips the clocksource read
+    TSC              // raw cycle counter, converted to wall time when rendered
+};
+
+// a raw clock reading, see clock::to_time_point
+struct timestamp {
+    std::uint64_t ticks = 0;
+    clock_source source = clock_source::REALTIME;
 };
 
+// file is expected to be a string literal (__FILE__)
 struct location {
-    std::string file = "unknown file";
-    size_t line = ~size_t(0);
-    size_t col = ~size_t(0);
+    const char* file = "unknown file";
+    std::uint32_t line = ~std::uint32_t(0);
+    std::uint32_t col = ~std::uint32_t(0);
 };
 
+// Only refers to long-lived strings (interned category names, literals),
+// so filling one in never allocates.
 struct message_info {
-    std::string category;
-    level level;
-    std::chrono::system_clock::time_point time_point;
-    std::thread::id thread_id;
-
+    const char* category = ""; // see util::intern
     // caller information (if available)
-    std::string caller = "unknown function";
+    const char* caller = "unknown function";
     location caller_location;
-};
 
-struct message_start {
-    message_info* info;
+    std::thread::id thread_id;
+    timestamp time_point; // taken once when the logger is created
+    streamlogger::level level;
 };
 
-struct message_end {
-    message_info* info;
-};
+static_assert(sizeof(message_info) <= 64, "message_info should fit a cache line");
 
 namespace util {
 
@@ -90,8 +129,36 @@ public:
         else sv.remove_prefix(where + 1);
         return res;
     }
+
+    // everything not consumed yet, separators included
+    essentials::string_view rest() {
+        auto res = sv;
+        sv = "";
+        return res;
+    }
 };
 
+// FNV-1a, for maps keyed by views into long-lived strings
+struct string_view_hash {
+    size_t operator()(essentials::string_view sv) const {
+        std::uint64_t h = 14695981039346656037ull;
+        for(char ch : sv) {
+            h ^= static_cast<unsigned char>(ch);
+            h *= 1099511628211ull;
+        }
+        return static_cast<size_t>(h);
+    }
+};
+
+// a stable, never freed copy of str
+inline const char* intern(const std::string& str) {
+    static std::mutex mutex;
+    static std::unordered_set<std::string> names;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    return names.insert(str).first->c_str();
+}
+
 inline std::chrono::seconds local_tz_offset() {
     using namespace std;
     using namespace std::chrono;
@@ -0,0 +1,112 @@
+#ifndef CONCURRENT_SINK_H
+#define CONCURRENT_SINK_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "common.h"
+#include "ring.h"
+#include "sink.h"
+
+namespace streamlogger {
+
+// Puts a lock-free byte_ring in front of another sink. Writers reserve space with one
+// atomic add, copy their record in and commit it; they never take sink_mutex. A single
+// flusher thread concatenates committed records and hands each contiguous batch to the
+// target in one write, so the target's lock is taken once per batch by one thread.
+class concurrent_sink: public sink {
+public:
+    enum class overflow { BLOCK, DROP };
+
+private:
+    std::shared_ptr<sink> target;
+    overflow on_full;
+    std::unique_ptr<char[]> memory;
+    byte_ring ring;
+
+    std::string batch;
+    level batch_level = level::ALL;
+    std::atomic<std::uint64_t> flush_requested{ 0 };
+    std::atomic<bool> stop{ false };
+    std::thread flusher;
+
+    void handle_start(const message_info&) override {}
+    void handle_end(const message_info&) override {}
+
+    void output(const message_info& mi, const char* data, size_t size) override {
+        auto tag = static_cast<std::uint32_t>(mi.level);
+        if(on_full == overflow::BLOCK) ring.write(data, size, tag);
+        else ring.try_write(data, size, tag);
+    }
+
+    size_t drain() {
+        return ring.consume(
+            [&](std::uint32_t tag, const char* data, size_t size) {
+                batch.append(data, size);
+                batch_level = std::max(batch_level, static_cast<level>(tag));
+            },
+            [&]{
+                // level carries the highest level in the batch, for the target's flush policy
+                message_info mi;
+                mi.level = batch_level;
+                target->write(mi, essentials::string_view(batch.data(), batch.size()));
+                batch.clear();
+                batch_level = level::ALL;
+            },
+            1024
+        );
+    }
+
+    void run() {
+        auto idle = std::chrono::microseconds(50);
+        for(;;) {
+            if(drain() != 0) {
+                idle = std::chrono::microseconds(50);
+                continue;
+            }
+            if(flush_requested.load(std::memory_order_acquire) != 0) {
+                target->flush();
+                flush_requested.store(0, std::memory_order_release);
+            }
+            if(stop.load(std::memory_order_acquire)) break;
+            std::this_thread::sleep_for(idle);
+            idle = std::min<std::chrono::microseconds>(idle * 2, std::chrono::milliseconds(5));
+        }
+        while(drain() != 0) {}
+        target->flush();
+    }
+
+public:
+    // capacity is rounded up to a power of two
+    explicit concurrent_sink(std::shared_ptr<sink> target, size_t capacity = 1 << 20, overflow on_full = overflow::BLOCK):
+        sink(),
+        target(std::move(target)),
+        on_full(on_full),
+        memory(new char[byte_ring::memory_size(byte_ring::round_capacity(capacity))]()),
+        ring(memory.get(), byte_ring::round_capacity(capacity), true),
+        flusher([this]{ run(); }) {}
+
+    virtual ~concurrent_sink() {
+        stop.store(true, std::memory_order_release);
+        flusher.join();
+    }
+
+    // waits until everything written so far has reached the target, then flushes it
+    void flush() override {
+        auto until = ring.reserved();
+        while(ring.released() < until) std::this_thread::sleep_for(std::chrono::microseconds(50));
+        flush_requested.store(1, std::memory_order_release);
+        while(flush_requested.load(std::memory_order_acquire) != 0) std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+    // records dropped by overflow::DROP or for being larger than half the capacity
+    std::uint64_t dropped() const { return ring.dropped(); }
+};
+
+} /* namespace streamlogger */
+
+#endif // CONCURRENT_SINK_H
@@ -1,40 +1,131 @@
 #ifndef CONFIGURATOR_H
 #define CONFIGURATOR_H
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include "lib/inih/INIReader.h"
 
 #include "category.h"
+#include "concurrent_sink.h"
+#include "deferred.h"
+#include "direct_sink.h"
+#include "flight_recorder.h"
+#include "rolling_sink.h"
+#include "shm_sink.h"
+#include "syslog_sink.h"
+#include "uring_sink.h"
 
 namespace streamlogger {
 
 class registry {
-    static std::shared_ptr<::streamlogger::category> root() {
-        static std::shared_ptr<::streamlogger::category> root_ = std::make_shared<::streamlogger::category>("");
-        return root_;
+    // An insert-only hash table of every category. Readers walk it without locking;
+    // inserts happen under data_mutex() and publish each node with a release store.
+    // Categories are only removed at exit.
+    struct node {
+        std::unique_ptr<::streamlogger::category> cat;
+        node* next;
+    };
+
+    static constexpr size_t bucket_count = 1024;
+
+    static std::atomic<node*>* buckets() {
+        static std::atomic<node*> result[bucket_count];
+        return result;
     }
 
-    static std::unordered_map<std::string, std::shared_ptr<::streamlogger::category>>& data() {
-        static std::unordered_map<std::string, std::shared_ptr<::streamlogger::category>> data_;
-        return data_;
+    static std::atomic<node*>& bucket_for(essentials::string_view name) {
+        return buckets()[util::string_view_hash{}(name) % bucket_count];
+    }
+
+    // Owns the nodes. Destroyed at exit like any static, and with it every category and
+    // the sinks that only categories hold, which flushes whatever they still buffer.
+    // The deferred backend writes into categories, so it is drained and stopped first.
+    struct node_list {
+        std::vector<std::unique_ptr<node>> nodes;
+
+        ~node_list() {
+            deferred::backend::instance().shutdown();
+            for(size_t i = 0; i < bucket_count; ++i) buckets()[i].store(nullptr, std::memory_order_release);
+        }
     };
 
+    static ::streamlogger::category* find(essentials::string_view name) {
+        for(auto n = bucket_for(name).load(std::memory_order_acquire); n; n = n->next) {
+            if(essentials::string_view(n->cat->name()) == name) return n->cat.get();
+        }
+        return nullptr;
+    }
+
+    // data_mutex() must be held
+    template<class F>
+    static void for_each_category(F f) {
+        for(auto&& entry : all_nodes().nodes) f(*entry->cat);
+    }
+
+    // data_mutex() must be held
+    static node_list& all_nodes() {
+        static node_list result;
+        return result;
+    }
+
+    static std::mutex& data_mutex() {
+        static std::mutex mutex_;
+        return mutex_;
+    }
+
+    // "net.http" for "net.http.client", "" (the root) for "net"
+    static essentials::string_view parent_of(essentials::string_view name) {
+        auto dot = name.find_last_of('.');
+        if(dot == essentials::string_view::npos) return "";
+        return name.substr(0, dot);
+    }
+
+    // data_mutex() must be held; missing ancestors are created as well
+    static ::streamlogger::category& lookup(essentials::string_view name) {
+        if(auto existing = find(name)) return *existing;
+
+        std::unique_ptr<::streamlogger::category> cat(new ::streamlogger::category(std::string(name.data(), name.size())));
+        // a category without configuration of its own behaves exactly like its parent
+        if(not name.empty()) cat->inherit(lookup(parent_of(name)));
+        auto&& bucket = bucket_for(name);
+        std::unique_ptr<node> n(new node{ std::move(cat), bucket.load(std::memory_order_relaxed) });
+        auto published = n.get();
+        all_nodes().nodes.push_back(std::move(n));
+        bucket.store(published, std::memory_order_release);
+        return *published->cat;
+    }
+
     struct appender {
         std::string type;
         std::string filename;
+        std::string layout; // class name, e.g. org.apache.log4j.PatternLayout
         std::string pattern;
         std::string threshold;
+        // appender-specific settings, e.g. bufferSize
+        std::unordered_map<std::string, std::string> properties;
+
+        std::string property(const std::string& key, const std::string& def = "") const {
+            auto it = properties.find(key);
+            return it == properties.end() ? def : it->second;
+        }
     };
 
     struct category {
         bool additive = true;
+        std::string level; // empty: inherited from the parent
         std::vector<std::string> appenders;
     };
 
     struct parse_state {
         std::unordered_map<std::string, appender> formatters;
         std::unordered_map<std::string, category> categories;
+        std::string clock;
+        bool async = false;
+        std::string async_overflow;
+        std::string async_queue_size;
     };
 
     static int ini_handler(void* user, const char* section, const char* name, const char* value) {
@@ -55,7 +146,10 @@ class registry {
                 return 0;
             }
 
-            if(field == "layout" && not name_split.has_next()) return 0; //ignore
+            if(field == "layout" && not name_split.has_next()) {
+                parse_state.formatters[appender_name].layout = util::trim(value);
+                return 0;
+            }
             if(field == "layout") {
                 auto patternField = util::trim(name_split.next());
                 if(patternField != "ConversionPattern") return -1;
@@ -67,13 +161,16 @@ class registry {
                 parse_state.formatters[appender_name].threshold = util::trim(value);
                 return 0;
             }
-            return -1; // nothing else supported atm
+            if(name_split.has_next()) return -1;
+            parse_state.formatters[appender_name].properties[field] = util::trim(value);
+            return 0;
         }
 
         if(keyword == "category" || keyword == "rootCategory") {
-            auto categoryName = util::trim(name_split.next());
+            auto categoryName = util::trim(name_split.rest());
             util::tokenizer value_split(",", value);
-            auto level = util::trim(value_split.next());
+            auto lvl = util::trim(value_split.next());
+            if(lvl != "INHERITED") parse_state.categories[categoryName].level = lvl;
             while(value_split.has_next()) {
                 parse_state.categories[categoryName].appenders.push_back(util::trim(value_split.next()));
             }
@@ -81,55 +178,307 @@ class registry {
         }
 
         if(keyword == "additivity") {
-            auto categoryName = util::trim(name_split.next());
+            auto categoryName = util::trim(name_split.rest());
             parse_state.categories[categoryName].additive = not (util::trim(value) == "false");
             return 0; // nothing else supported atm
         }
 
+        if(keyword == "clock") {
+            parse_state.clock = util::trim(value);
+            return 0;
+        }
+
+        if(keyword == "async") {
+            if(not name_split.has_next()) {
+                parse_state.async = (util::trim(value) == "true");
+                return 0;
+            }
+            auto field = util::trim(name_split.next());
+            if(field == "overflow") {
+                parse_state.async_overflow = util::trim(value);
+                return 0;
+            }
+            if(field == "queueSize") {
+                parse_state.async_queue_size = util::trim(value);
+                return 0;
+            }
+            return -1;
+        }
+
         return -1;
     }
 
+    // JsonLayout and LogfmtLayout, with or without a package prefix; PatternLayout otherwise
+    static std::unique_ptr<layout> parse_layout(const appender& ap) {
+        essentials::string_view name = ap.layout;
+        auto dot = name.rfind('.');
+        if(dot != essentials::string_view::npos) name.remove_prefix(dot + 1);
+        if(name == "JsonLayout" || name == "JSONLayout") return std::unique_ptr<layout>(new json_layout());
+        if(name == "LogfmtLayout") return std::unique_ptr<layout>(new logfmt_layout());
+        return std::unique_ptr<layout>(new pattern_layout(ap.pattern));
+    }
+
+    static flush_policy parse_flush_policy(const appender& ap) {
+        flush_policy res;
+        auto size = ap.property("bufferSize");
+        if(not size.empty()) res.buffer_size = std::stoul(size);
+        auto interval = ap.property("flushInterval");
+        if(not interval.empty()) res.interval = std::chrono::milliseconds(std::stol(interval));
+        auto immediate = ap.property("immediateFlush");
+        if(not immediate.empty()) res.immediate = parse_level(immediate.c_str());
+        return res;
+    }
+
+    // a byte count with an optional KB/MB/GB suffix
+    static size_t parse_size(const std::string& str) {
+        size_t pos = 0;
+        size_t value = std::stoul(str, &pos);
+        auto suffix = util::trim(essentials::string_view(str).substr(pos));
+        if(suffix == "KB" || suffix == "K") return value << 10;
+        if(suffix == "MB" || suffix == "M") return value << 20;
+        if(suffix == "GB" || suffix == "G") return value << 30;
+        return value;
+    }
+
+    static rolling_file_sink::options parse_rolling_options(const appender& ap) {
+        rolling_file_sink::options res;
+        auto size = ap.property("maxFileSize");
+        if(not size.empty()) res.max_size = parse_size(size);
+        auto interval = ap.property("rollInterval");
+        if(interval == "hourly") res.interval = std::chrono::hours(1);
+        else if(interval == "daily") res.interval = std::chrono::hours(24);
+        else if(not interval.empty()) res.interval = std::chrono::seconds(std::stol(interval));
+        auto backups = ap.property("maxBackupIndex");
+        if(not backups.empty()) res.max_files = std::stoul(backups);
+        auto total = ap.property("maxTotalSize");
+        if(not total.empty()) res.max_total_size = parse_size(total);
+        res.compress = ap.property("compress") == "true";
+#ifndef STREAMLOGGER_WITH_ZLIB
+        if(res.compress) throw std::runtime_error("compress=true needs STREAMLOGGER_WITH_ZLIB: " + ap.filename);
+#endif
+        return res;
+    }
+
+    static int parse_facility(const std::string& str) {
+        static const char* names[] = {
+            "kern", "user", "mail", "daemon", "auth", "syslog", "lpr", "news",
+            "uucp", "cron", "authpriv", "ftp", "ntp", "security", "console", "clock",
+            "local0", "local1", "local2", "local3", "local4", "local5", "local6", "local7"
+        };
+        for(int i = 0; i < 24; ++i) {
+            if(str == names[i]) return i;
+        }
+        return std::stoi(str);
+    }
+
+    static syslog_sink::options parse_syslog_options(const appender& ap) {
+        syslog_sink::options res;
+        res.path = ap.property("socket", res.path);
+        if(ap.property("format") == "RFC3164") res.frame = syslog_sink::format::RFC3164;
+        auto facility = ap.property("facility");
+        if(not facility.empty()) res.facility = parse_facility(facility);
+        res.app_name = ap.property("appName", res.app_name);
+        auto batch = ap.property("batchSize");
+        if(not batch.empty()) res.batch = std::stoul(batch);
+        res.policy = parse_flush_policy(ap);
+        return res;
+    }
+
+    static int parse_signal(essentials::string_view name) {
+        static const std::pair<const char*, int> names[] = {
+            { "SIGHUP", SIGHUP }, { "SIGINT", SIGINT }, { "SIGQUIT", SIGQUIT }, { "SIGILL", SIGILL },
+            { "SIGABRT", SIGABRT }, { "SIGBUS", SIGBUS }, { "SIGFPE", SIGFPE }, { "SIGSEGV", SIGSEGV },
+            { "SIGTERM", SIGTERM }, { "SIGUSR1", SIGUSR1 }, { "SIGUSR2", SIGUSR2 }
+        };
+        for(auto&& n : names) {
+            if(name == n.first) return n.second;
+        }
+        return std::stoi(std::string(name));
+    }
+
 public:
     static void configure(const std::string& logini) {
         parse_state ps;
         ini_parse(logini.c_str(), ini_handler, &ps);
 
+        if(not ps.clock.empty()) clock::set_source(parse_clock_source(ps.clock));
+
         std::unordered_map<std::string, std::shared_ptr<sink>> sinks;
         for(auto&& ap : ps.formatters) {
             if(ap.second.type == "FileAppender") {
-                sinks[ap.first] = file_sink::instance(ap.second.filename);
+                auto backend = ap.second.property("backend");
+                if(backend == "direct") {
+                    sinks[ap.first] = direct_file_sink::instance(ap.second.filename, parse_flush_policy(ap.second));
+                } else if(backend == "io_uring") {
+                    auto depth = ap.second.property("queueDepth", "8");
+                    sinks[ap.first] = uring_file_sink::instance(
+                        ap.second.filename,
+                        parse_flush_policy(ap.second),
+                        static_cast<unsigned>(std::stoul(depth))
+                    );
+                } else sinks[ap.first] = file_sink::instance(ap.second.filename, parse_flush_policy(ap.second));
+            }
+            if(ap.second.type == "RollingFileAppender") {
+                sinks[ap.first] = rolling_file_sink::instance(
+                    ap.second.filename,
+                    parse_rolling_options(ap.second),
+                    parse_flush_policy(ap.second)
+                );
+            }
+            if(ap.second.type == "MMapFileAppender") {
+                auto window = ap.second.property("chunkSize");
+                sinks[ap.first] = window.empty()
+                    ? mmap_file_sink::instance(ap.second.filename)
+                    : mmap_file_sink::instance(ap.second.filename, parse_size(window));
+            }
+            if(ap.second.type == "SyslogAppender") {
+                sinks[ap.first] = syslog_sink::instance(parse_syslog_options(ap.second));
             }
             if(ap.second.type == "ConsoleAppender") {
-                sinks[ap.first] = cout_sink::instance();
+                auto mode = ap.second.property("buffering");
+                auto buffering = mode == "line" ? console_sink::buffering::LINE
+                               : mode == "block" ? console_sink::buffering::BLOCK
+                               : console_sink::buffering::AUTO;
+                if(ap.second.property("target") == "System.err") {
+                    sinks[ap.first] = cerr_sink::instance(buffering, parse_flush_policy(ap.second));
+                } else sinks[ap.first] = cout_sink::instance(buffering, parse_flush_policy(ap.second));
+            }
+            if(ap.second.type == "FlightRecorderAppender") {
+                auto size = ap.second.property("size");
+                sinks[ap.first] = std::make_shared<flight_recorder_sink>(
+                    ap.second.filename,
+                    size.empty() ? 8 << 20 : parse_size(size),
+                    parse_level(ap.second.property("dumpLevel", "FATAL").c_str())
+                );
+                auto signal_names = ap.second.property("dumpSignals");
+                util::tokenizer signals(",", signal_names);
+                while(signals.has_next()) {
+                    auto name = util::trim(signals.next());
+                    if(not name.empty()) flight_recorder_sink::dump_on_signal(parse_signal(name));
+                }
+            }
+            if(ap.second.type == "SharedMemoryAppender") {
+                auto size = ap.second.property("size");
+                sinks[ap.first] = shm_ring_sink::instance(ap.second.property("name"), size.empty() ? 4 << 20 : parse_size(size));
             }
         }
 
-        for(auto&& cat : ps.categories) {
-            data()[cat.first] = std::make_shared<::streamlogger::category>(cat.first);
-            for(auto&& ap : cat.second.appenders) {
-                data()[cat.first]->add_sink(
-                    sinks[ap],
-                    ps.formatters[ap].pattern,
-                    parse_level(ps.formatters[ap].threshold.c_str())
-                );
+        // concurrent=true puts a lock-free ring in front of the appender's sink
+        for(auto&& ap : ps.formatters) {
+            if(not sinks[ap.first] || ap.second.property("concurrent") != "true") continue;
+            auto size = ap.second.property("concurrentBufferSize");
+            sinks[ap.first] = std::make_shared<concurrent_sink>(
+                sinks[ap.first],
+                size.empty() ? 1 << 20 : parse_size(size),
+                ap.second.property("overflow") == "drop" ? concurrent_sink::overflow::DROP : concurrent_sink::overflow::BLOCK
+            );
+        }
+
+        // collectors write to other appenders' sinks, so they start once all sinks exist
+        for(auto&& ap : ps.formatters) {
+            auto collect = ap.second.property("collectInto");
+            if(ap.second.type != "SharedMemoryAppender" || collect.empty()) continue;
+            std::vector<std::shared_ptr<sink>> targets;
+            util::tokenizer names(",", collect);
+            while(names.has_next()) {
+                auto name = util::trim(names.next());
+                auto it = sinks.find(std::string(name));
+                if(it != sinks.end() && it->second) targets.push_back(it->second);
+            }
+            std::static_pointer_cast<shm_ring_sink>(sinks[ap.first])->collect_into(std::move(targets));
+        }
+
+        // one formatter per appender, shared by every category writing to it
+        std::unordered_map<std::string, std::shared_ptr<formatter>> formatters;
+        for(auto&& ap : ps.formatters) {
+            if(not sinks[ap.first]) continue;
+            formatters[ap.first] = std::make_shared<formatter>(
+                sinks[ap.first],
+                parse_layout(ap.second),
+                parse_level(ap.second.threshold.c_str())
+            );
+        }
+
+        // reconfigure() below creates the dispatcher, which only reads the capacity once
+        if(ps.async && not ps.async_queue_size.empty()) {
+            async_dispatcher::default_capacity() = std::stoul(ps.async_queue_size);
+        }
+
+        std::lock_guard<std::mutex> lock(data_mutex());
+
+        for(auto&& cat : ps.categories) lookup(cat.first);
+
+        // Flatten the hierarchy: every category gets its effective level and the
+        // formatters of itself and its ancestors up to the first non-additive one.
+        // Each category switches to its new configuration in one atomic step, so
+        // resolved category_handles stay valid and concurrent records are not lost.
+        for_each_category([&](::streamlogger::category& target) {
+            level effective = level::ALL;
+            std::vector<std::shared_ptr<formatter>> attached;
+            essentials::string_view name = target.name();
+            bool level_set = false;
+            bool appending = true;
+            for(;;) {
+                auto it = ps.categories.find(std::string(name.data(), name.size()));
+                if(it != ps.categories.end()) {
+                    auto&& conf = it->second;
+                    if(not level_set && not conf.level.empty()) {
+                        effective = parse_level(conf.level.c_str());
+                        level_set = true;
+                    }
+                    if(appending) {
+                        for(auto&& ap : conf.appenders) {
+                            auto form = formatters.find(ap);
+                            if(form != formatters.end()) attached.push_back(form->second);
+                        }
+                        appending = conf.additive;
+                    }
+                }
+                if(name.empty() || (level_set && not appending)) break;
+                name = parent_of(name);
             }
+
+            target.reconfigure(effective, std::move(attached), ps.async);
+        });
+
+        if(ps.async) {
+            async_dispatcher::instance().set_overflow(
+                ps.async_overflow == "drop" ? async_dispatcher::overflow::DROP : async_dispatcher::overflow::BLOCK
+            );
+        }
+    }
+
+    // Lock-free. A name without a category of its own resolves to its nearest registered
+    // ancestor (the root at worst) and is not added, so arbitrary dynamic names cost no
+    // memory; records then carry the ancestor's name.
+    static ::streamlogger::category& getCategory(essentials::string_view category) {
+        for(;;) {
+            if(auto cat = find(category)) return *cat;
+            if(category.empty()) break;
+            category = parent_of(category);
         }
+        std::lock_guard<std::mutex> lock(data_mutex());
+        return lookup("");
+    }
 
+    // Adds the category (and its ancestors) if needed. The reference stays valid, and
+    // follows reconfiguration, for the program's lifetime; meant for category_handle.
+    static ::streamlogger::category& registerCategory(essentials::string_view category) {
+        std::lock_guard<std::mutex> lock(data_mutex());
+        return lookup(category);
     }
 
-    static logger getLogger(const std::string& category, level lvl) {
-        auto it = data().find(category);
-        if(it == data().end()) return getLogger("", lvl);
-        else return it->second->logger(lvl);
+    static logger getLogger(essentials::string_view category, level lvl) {
+        return getCategory(category).logger(lvl);
     }
 
-    static logger all(const std::string& category) { return getLogger(category, level::ALL); }
-    static logger trace(const std::string& category) { return getLogger(category, level::TRACE); }
-    static logger debug(const std::string& category) { return getLogger(category, level::DEBUG); }
-    static logger info(const std::string& category) { return getLogger(category, level::INFO); }
-    static logger warn(const std::string& category) { return getLogger(category, level::WARN); }
-    static logger error(const std::string& category) { return getLogger(category, level::ERROR); }
-    static logger fatal(const std::string& category) { return getLogger(category, level::FATAL); }
+    static logger all(essentials::string_view category) { return getLogger(category, level::ALL); }
+    static level_logger<level::TRACE> trace(essentials::string_view category) { return getCategory(category).trace(); }
+    static level_logger<level::DEBUG> debug(essentials::string_view category) { return getCategory(category).debug(); }
+    static level_logger<level::INFO> info(essentials::string_view category) { return getCategory(category).info(); }
+    static level_logger<level::WARN> warn(essentials::string_view category) { return getCategory(category).warn(); }
+    static level_logger<level::ERROR> error(essentials::string_view category) { return getCategory(category).error(); }
+    static level_logger<level::FATAL> fatal(essentials::string_view category) { return getCategory(category).fatal(); }
 
 };
 
@@ -137,17 +486,48 @@ static void configure(const std::string& logini) {
     registry::configure(logini);
 }
 
-static logger getLogger(const std::string& category, level lvl) {
+static category& getCategory(essentials::string_view category) {
+    return registry::getCategory(category);
+}
+
+static logger getLogger(essentials::string_view category, level lvl) {
     return registry::getLogger(category, lvl);
 }
 
-static logger all(const std::string& category) { return registry::all(category); }
-static logger trace(const std::string& category) { return registry::trace(category); }
-static logger debug(const std::string& category) { return registry::debug(category); }
-static logger info(const std::string& category) { return registry::info(category); }
-static logger warn(const std::string& category) { return registry::warn(category); }
-static logger error(const std::string& category) { return registry::error(category); }
-static logger fatal(const std::string& category) { return registry::fatal(category); }
+static logger all(essentials::string_view category) { return registry::all(category); }
+static level_logger<level::TRACE> trace(essentials::string_view category) { return registry::trace(category); }
+static level_logger<level::DEBUG> debug(essentials::string_view category) { return registry::debug(category); }
+static level_logger<level::INFO> info(essentials::string_view category) { return registry::info(category); }
+static level_logger<level::WARN> warn(essentials::string_view category) { return registry::warn(category); }
+static level_logger<level::ERROR> error(essentials::string_view category) { return registry::error(category); }
+static level_logger<level::FATAL> fatal(essentials::string_view category) { return registry::fatal(category); }
+
+// A category resolved once, e.g. a function-local static at the call site:
+//     static category_handle net("net");
+//     net.info() << ...;  STREAMLOGGER_DEBUG(net) << ...;
+class category_handle {
+    ::streamlogger::category* category_;
+
+public:
+    explicit category_handle(essentials::string_view name): category_(&registry::registerCategory(name)) {}
+
+    ::streamlogger::category& operator*() const { return *category_; }
+    ::streamlogger::category* operator->() const { return category_; }
+
+    bool enabled(level lvl) const { return category_->enabled(lvl); }
+
+    ::streamlogger::logger logger(level lvl) const { return category_->logger(lvl); }
+    ::streamlogger::logger logger(level lvl, const char* caller, const location& loc) const {
+        return category_->logger(lvl, caller, loc);
+    }
+
+    level_logger<level::TRACE> trace() const { return category_->trace(); }
+    level_logger<level::DEBUG> debug() const { return category_->debug(); }
+    level_logger<level::INFO>  info()  const { return category_->info();  }
+    level_logger<level::WARN>  warn()  const { return category_->warn();  }
+    level_logger<level::ERROR> error() const { return category_->error(); }
+    level_logger<level::FATAL> fatal() const { return category_->fatal(); }
+};
 
 } /* namespace streamlogger */
 
@@ -0,0 +1,455 @@
+#ifndef DEFERRED_H
+#define DEFERRED_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "binary_log.h"
+#include "buffer.h"
+#include "category.h"
+#include "ring.h"
+#include "timestamp.h"
+
+namespace streamlogger {
+namespace deferred {
+
+using binlog::arg_type;
+
+// A string argument that is only referenced, never copied: string literals and other
+// strings that live as long as logging does.
+struct literal {
+    const char* data;
+    std::uint32_t size;
+
+    template<size_t N>
+    literal(const char (&str)[N]): data(str), size(N - 1) {}
+    literal(const char* data, size_t size): data(data), size(static_cast<std::uint32_t>(size)) {}
+};
+
+template<class T, class = void>
+struct arg_traits {
+    static_assert(sizeof(T) == 0, "deferred logging supports integers, floating point, bool, char, pointers and strings");
+};
+
+template<class T>
+struct arg_traits<T, std::enable_if_t<std::is_integral<T>::value && std::is_signed<T>::value && not std::is_same<T, char>::value>> {
+    static constexpr arg_type type = arg_type::INT;
+    static size_t encode(char* out, size_t, T v) {
+        auto value = static_cast<std::int64_t>(v);
+        std::memcpy(out, &value, 8);
+        return 8;
+    }
+};
+
+template<class T>
+struct arg_traits<T, std::enable_if_t<std::is_integral<T>::value && std::is_unsigned<T>::value && not std::is_same<T, bool>::value>> {
+    static constexpr arg_type type = arg_type::UINT;
+    static size_t encode(char* out, size_t, T v) {
+        auto value = static_cast<std::uint64_t>(v);
+        std::memcpy(out, &value, 8);
+        return 8;
+    }
+};
+
+template<class T>
+struct arg_traits<T, std::enable_if_t<std::is_floating_point<T>::value>> {
+    static constexpr arg_type type = arg_type::DOUBLE;
+    static size_t encode(char* out, size_t, T v) {
+        auto value = static_cast<double>(v);
+        std::memcpy(out, &value, 8);
+        return 8;
+    }
+};
+
+template<>
+struct arg_traits<bool> {
+    static constexpr arg_type type = arg_type::BOOL;
+    static size_t encode(char* out, size_t, bool v) {
+        *out = v ? 1 : 0;
+        return 1;
+    }
+};
+
+template<>
+struct arg_traits<char> {
+    static constexpr arg_type type = arg_type::CHAR;
+    static size_t encode(char* out, size_t, char v) {
+        *out = v;
+        return 1;
+    }
+};
+
+struct string_traits {
+    static constexpr arg_type type = arg_type::STRING;
+    // longer strings are cut to what the record has room for
+    static size_t encode(char* out, size_t room, essentials::string_view sv) {
+        auto size = static_cast<std::uint32_t>(std::min(sv.size(), room - 4));
+        std::memcpy(out, &size, 4);
+        std::memcpy(out + 4, sv.data(), size);
+        return 4 + size;
+    }
+};
+
+template<> struct arg_traits<std::string>: string_traits {};
+template<> struct arg_traits<essentials::string_view>: string_traits {};
+
+template<>
+struct arg_traits<const char*>: string_traits {
+    static size_t encode(char* out, size_t room, const char* str) {
+        return string_traits::encode(out, room, str ? essentials::string_view(str) : essentials::string_view());
+    }
+};
+template<> struct arg_traits<char*>: arg_traits<const char*> {};
+
+template<>
+struct arg_traits<literal> {
+    static constexpr arg_type type = arg_type::LITERAL;
+    static size_t encode(char* out, size_t, literal lit) {
+        std::memcpy(out, &lit.data, sizeof(lit.data));
+        std::memcpy(out + sizeof(lit.data), &lit.size, 4);
+        return sizeof(lit.data) + 4;
+    }
+};
+
+template<class T>
+struct arg_traits<T*, std::enable_if_t<not std::is_same<std::remove_cv_t<T>, char>::value>> {
+    static constexpr arg_type type = arg_type::POINTER;
+    static size_t encode(char* out, size_t, const T* p) {
+        auto value = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(p));
+        std::memcpy(out, &value, 8);
+        return 8;
+    }
+};
+
+template<class T>
+using traits_of = arg_traits<std::decay_t<T>>;
+
+// the bytes reserved for one string argument when a record has n arguments
+constexpr size_t max_record = 2048;
+constexpr size_t record_header = 9; // clock ticks and source
+constexpr size_t string_room(size_t n) {
+    return (max_record - record_header) / (n == 0 ? 1 : n);
+}
+
+struct site {
+    binlog::site_info info;
+    category* target;
+    const char* category_name; // interned
+    const char* function;
+    location loc;
+};
+
+class site_registry {
+    static constexpr size_t max_sites = binlog::max_sites;
+    std::atomic<const site*> sites[max_sites];
+    std::atomic<std::uint32_t> count{ 0 };
+
+public:
+    static site_registry& instance() {
+        static site_registry result;
+        return result;
+    }
+
+    // false once max_sites sites exist; such sites never log
+    bool add(site& s) {
+        auto id = count.fetch_add(1, std::memory_order_relaxed);
+        if(id >= max_sites) return false;
+        s.info.id = id;
+        sites[id].store(&s, std::memory_order_release);
+        return true;
+    }
+
+    const site* get(std::uint32_t id) const {
+        return id < max_sites ? sites[id].load(std::memory_order_acquire) : nullptr;
+    }
+};
+
+// one per logging thread; only that thread writes, the backend reads
+struct thread_buffer {
+    std::unique_ptr<char[]> memory;
+    byte_ring ring;
+    std::thread::id thread_id;
+    std::uint32_t ordinal;
+    std::atomic<bool> retired{ false };
+
+    thread_buffer(size_t capacity, std::uint32_t ordinal):
+        memory(new char[byte_ring::memory_size(capacity)]()),
+        ring(memory.get(), capacity, true),
+        thread_id(std::this_thread::get_id()),
+        ordinal(ordinal) {}
+};
+
+// Drains every thread's buffer on a background thread and either renders the records
+// into their categories, or appends them to a binary log file (see binary_log.h) for
+// offline decoding.
+class backend {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<thread_buffer>> buffers;
+    std::uint32_t next_ordinal = 0;
+    size_t buffer_size = 1 << 20;
+    std::unique_ptr<std::thread> worker;
+    std::atomic<bool> stop{ false };
+
+    // binary output, touched by the worker only (and set up before it matters)
+    int fd = -1;
+    std::vector<bool> written_sites;
+    std::string site_chunk;
+    std::uint32_t site_count = 0;
+    std::string record_chunk;
+    std::uint32_t record_count = 0;
+
+    buffer body;
+
+    backend() = default;
+
+    void write_chunk(binlog::chunk_type type, std::string& payload, std::uint32_t count) {
+        if(payload.empty()) return;
+        binlog::chunk_header header{ static_cast<std::uint32_t>(type), static_cast<std::uint32_t>(payload.size()), count, 0 };
+        std::string out(reinterpret_cast<const char*>(&header), sizeof(header));
+        out += payload;
+        auto data = out.data();
+        auto size = out.size();
+        while(size > 0) {
+            auto written = ::write(fd, data, size);
+            if(written < 0) {
+                if(errno == EINTR) continue;
+                break;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+        payload.clear();
+    }
+
+    void flush_chunks() {
+        if(fd < 0) return;
+        write_chunk(binlog::chunk_type::SITES, site_chunk, site_count);
+        write_chunk(binlog::chunk_type::RECORDS, record_chunk, record_count);
+        site_count = record_count = 0;
+    }
+
+    void render(const thread_buffer& tb, const site& s, binlog::reader& in) {
+        message_info mi;
+        mi.category = s.category_name;
+        mi.level = s.info.lvl;
+        mi.caller = s.function;
+        mi.caller_location = s.loc;
+        mi.thread_id = tb.thread_id;
+        mi.time_point.ticks = in.get<std::uint64_t>();
+        mi.time_point.source = static_cast<clock_source>(in.get<std::uint8_t>());
+
+        body.clear();
+        if(binlog::render(s.info, in, body)) s.target->write(mi, body.view());
+    }
+
+    void store(const thread_buffer& tb, const site& s, binlog::reader& in) {
+        if(written_sites.size() <= s.info.id) written_sites.resize(s.info.id + 1);
+        if(not written_sites[s.info.id]) {
+            binlog::write_site(site_chunk, s.info);
+            ++site_count;
+            written_sites[s.info.id] = true;
+        }
+
+        timestamp ts;
+        ts.ticks = in.get<std::uint64_t>();
+        ts.source = static_cast<clock_source>(in.get<std::uint8_t>());
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::to_time_point(ts).time_since_epoch()).count();
+
+        binlog::put(record_chunk, s.info.id);
+        binlog::put(record_chunk, tb.ordinal);
+        binlog::put(record_chunk, static_cast<std::uint64_t>(ns));
+        auto size_at = record_chunk.size();
+        binlog::put(record_chunk, std::uint32_t(0));
+        if(not binlog::transcode_args(s.info, in, record_chunk)) {
+            record_chunk.resize(size_at - 16);
+            return;
+        }
+        auto size = static_cast<std::uint32_t>(record_chunk.size() - size_at - 4);
+        if(record_chunk.size() > binlog::max_chunk_size) {
+            record_chunk.resize(size_at - 16);
+            return;
+        }
+        std::memcpy(&record_chunk[size_at], &size, 4);
+        ++record_count;
+
+        if(record_chunk.size() >= (1 << 16)) flush_chunks();
+    }
+
+    size_t drain(thread_buffer& tb) {
+        return tb.ring.consume([&](std::uint32_t id, const char* data, size_t size) {
+            auto s = site_registry::instance().get(id);
+            if(not s) return;
+            binlog::reader in(data, size);
+            if(fd >= 0) store(tb, *s, in);
+            else render(tb, *s, in);
+        });
+    }
+
+    size_t drain_all() {
+        std::vector<std::shared_ptr<thread_buffer>> current;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current = buffers;
+        }
+        size_t count = 0;
+        for(auto&& tb : current) {
+            count += drain(*tb);
+            if(tb->retired.load(std::memory_order_acquire) && tb->ring.released() == tb->ring.reserved()) {
+                std::lock_guard<std::mutex> lock(mutex);
+                buffers.erase(std::remove(buffers.begin(), buffers.end(), tb), buffers.end());
+            }
+        }
+        return count;
+    }
+
+    void run() {
+        auto idle = std::chrono::microseconds(50);
+        while(not stop.load(std::memory_order_acquire)) {
+            if(drain_all() != 0) {
+                idle = std::chrono::microseconds(50);
+                continue;
+            }
+            flush_chunks();
+            std::this_thread::sleep_for(idle);
+            idle = std::min<std::chrono::microseconds>(idle * 2, std::chrono::milliseconds(5));
+        }
+        while(drain_all() != 0) {}
+        flush_chunks();
+    }
+
+    struct holder {
+        std::shared_ptr<thread_buffer> tb;
+        ~holder() {
+            if(tb) tb->retired.store(true, std::memory_order_release);
+        }
+    };
+
+public:
+    // never destroyed, see shutdown()
+    static backend& instance() {
+        static backend* result = new backend();
+        return *result;
+    }
+
+    // per-thread buffer capacity for threads that have not logged yet
+    void set_buffer_size(size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        buffer_size = byte_ring::round_capacity(size);
+    }
+
+    // Append records to a binary log file instead of rendering them; call before the
+    // first deferred record is written.
+    bool write_binary(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0) return false;
+        return ::write(fd, binlog::magic, binlog::magic_size) == static_cast<ssize_t>(binlog::magic_size);
+    }
+
+    // the calling thread's buffer
+    thread_buffer& local() {
+        static thread_local holder h;
+        if(not h.tb) {
+            std::lock_guard<std::mutex> lock(mutex);
+            h.tb = std::make_shared<thread_buffer>(buffer_size, next_ordinal++);
+            buffers.push_back(h.tb);
+            if(not worker) worker.reset(new std::thread([this]{ run(); }));
+        }
+        return *h.tb;
+    }
+
+    // waits until everything logged before the call has been rendered or stored
+    void flush() {
+        std::vector<std::pair<std::shared_ptr<thread_buffer>, std::uint64_t>> targets;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for(auto&& tb : buffers) targets.emplace_back(tb, tb->ring.reserved());
+        }
+        for(auto&& t : targets) {
+            while(t.first->ring.released() < t.second) std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+    // Drains everything, stops the thread and closes the binary file. Called at exit
+    // before the registry's categories are destroyed; call it earlier for categories
+    // that do not belong to the registry.
+    void shutdown() {
+        stop.store(true, std::memory_order_release);
+        if(worker) worker->join();
+        worker.reset();
+        if(fd >= 0) ::close(fd);
+        fd = -1;
+    }
+
+    // records dropped because a thread's buffer was full
+    std::uint64_t dropped() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::uint64_t res = 0;
+        for(auto&& tb : buffers) res += tb->ring.dropped();
+        return res;
+    }
+};
+
+template<class... Args>
+const site& make_site(category& cat, level lvl, const char* format, const char* function, location loc, const Args&...) {
+    auto s = new site(); // lives as long as the program
+    s->info.lvl = lvl;
+    s->info.line = loc.line;
+    s->info.category = cat.name();
+    s->info.format = format;
+    s->info.file = loc.file;
+    s->info.function = function;
+    s->info.types = { traits_of<Args>::type... };
+    s->info.split_format();
+    s->target = &cat;
+    s->category_name = util::intern(cat.name());
+    s->function = function;
+    s->loc = loc;
+    if(not site_registry::instance().add(*s)) s->target = nullptr;
+    return *s;
+}
+
+// copies the arguments' bytes into the calling thread's buffer
+template<class... Args>
+void write(const site& s, const Args&... args) {
+    if(not s.target) return;
+    char record[max_record];
+    auto ts = clock::now();
+    std::memcpy(record, &ts.ticks, 8);
+    record[8] = static_cast<char>(ts.source);
+    size_t pos = record_header;
+    int expand[] = { 0, (pos += traits_of<Args>::encode(record + pos, string_room(sizeof...(Args)), args), 0)... };
+    (void) expand;
+    backend::instance().local().ring.try_write(record, pos, s.info.id);
+}
+
+} /* namespace deferred */
+} /* namespace streamlogger */
+
+// Logs FORMAT with each {} replaced by the next argument, rendering it later on the
+// deferred::backend thread. The site (category, level, format, argument types) is
+// registered on first use, so LEVEL must be the same every time the statement runs.
+//     STREAMLOGGER_DEFER(cat, level::INFO, "fill {} @ {}", qty, price);
+#define STREAMLOGGER_DEFER(CATEGORY, LEVEL, FORMAT, ...) \
+    do { \
+        auto& sl_category_ = (CATEGORY); \
+        if(::streamlogger::compiled_in(LEVEL) && sl_category_.enabled(LEVEL)) { \
+            static const ::streamlogger::deferred::site& sl_site_ = ::streamlogger::deferred::make_site( \
+                sl_category_, (LEVEL), FORMAT, __func__, ::streamlogger::location{ __FILE__, __LINE__ }, ##__VA_ARGS__); \
+            ::streamlogger::deferred::write(sl_site_, ##__VA_ARGS__); \
+        } \
+    } while(false)
+
+#endif // DEFERRED_H
@@ -0,0 +1,255 @@
+#ifndef DIRECT_SINK_H
+#define DIRECT_SINK_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "sink.h"
+
+namespace streamlogger {
+
+// A file_sink that bypasses the page cache with O_DIRECT. Records are copied into one of
+// two aligned buffers; a full buffer is written by a background thread while the other
+// one fills. Flushes write the partial tail block zero-padded and truncate the file back
+// to its real length, so the file is always readable up to the last flush.
+// Where O_DIRECT is not supported (e.g. tmpfs) the same writes go through the page cache.
+class direct_file_sink: public file_sink {
+    static constexpr size_t alignment = 4096;
+
+    struct aligned_free {
+        void operator()(char* p) const { std::free(p); }
+    };
+    using aligned_buffer = std::unique_ptr<char, aligned_free>;
+
+    struct write_result {
+        size_t writes = 0;
+        size_t bytes = 0;
+        size_t errors = 0;
+    };
+
+    size_t capacity;
+    aligned_buffer buffers[2];
+    int active = 0;
+    size_t used = 0;
+    size_t synced = 0;     // bytes of the active buffer already on disk
+    off_t buffer_offset = 0; // file offset of the active buffer
+
+    // background writer, one full buffer at a time
+    std::mutex write_mutex;
+    std::condition_variable write_cv;
+    const char* job_data = nullptr;
+    off_t job_offset = 0;
+    write_result job_result;
+    bool done = false;
+    std::thread writer;
+
+    static size_t round_up(size_t size) {
+        return (size + alignment - 1) / alignment * alignment;
+    }
+
+    static aligned_buffer allocate(size_t size) {
+        void* p = nullptr;
+        if(::posix_memalign(&p, alignment, size) != 0) throw std::bad_alloc();
+        return aligned_buffer(static_cast<char*>(p));
+    }
+
+    static int open_direct(const char* name) {
+        int flags = O_RDWR | O_CREAT | O_CLOEXEC;
+        int res = ::open(name, flags | O_DIRECT, 0644);
+        if(res < 0 && errno == EINVAL) res = ::open(name, flags, 0644);
+        return res;
+    }
+
+    static flush_policy without_interval(flush_policy policy) {
+        policy.interval = std::chrono::milliseconds(0);
+        return policy;
+    }
+
+    static void write_at(int fd, const char* data, size_t size, off_t offset, write_result& res) {
+        while(size > 0) {
+            auto written = ::pwrite(fd, data, size, offset);
+            if(written < 0) {
+                if(errno == EINTR) continue;
+                ++res.errors;
+                return;
+            }
+            ++res.writes;
+            res.bytes += static_cast<size_t>(written);
+            data += written;
+            size -= static_cast<size_t>(written);
+            offset += written;
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(write_mutex);
+        for(;;) {
+            write_cv.wait(lock, [this]{ return done || job_data; });
+            if(not job_data) return;
+            auto data = job_data;
+            auto offset = job_offset;
+            lock.unlock();
+            write_result res;
+            write_at(fd, data, capacity, offset, res);
+            lock.lock();
+            job_result.writes += res.writes;
+            job_result.bytes += res.bytes;
+            job_result.errors += res.errors;
+            job_data = nullptr;
+            write_cv.notify_all();
+        }
+    }
+
+    // sink_mutex must be held
+    void wait_idle() {
+        std::unique_lock<std::mutex> lock(write_mutex);
+        write_cv.wait(lock, [this]{ return not job_data; });
+        stats_.writes += job_result.writes;
+        stats_.bytes += job_result.bytes;
+        stats_.errors += job_result.errors;
+        job_result = {};
+    }
+
+    // sink_mutex must be held; hands the full active buffer to the writer
+    void submit_full() {
+        wait_idle();
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            job_data = buffers[active].get();
+            job_offset = buffer_offset;
+        }
+        write_cv.notify_all();
+        buffer_offset += static_cast<off_t>(capacity);
+        active ^= 1;
+        used = synced = 0;
+    }
+
+    // sink_mutex must be held; writes the partial tail padded to a block and trims the file
+    void sync_tail() {
+        wait_idle();
+        if(used == synced) return;
+        auto padded = round_up(used);
+        auto buf = buffers[active].get();
+        std::memset(buf + used, 0, padded - used);
+        write_result res;
+        write_at(fd, buf, padded, buffer_offset, res);
+        if(::ftruncate(fd, buffer_offset + static_cast<off_t>(used)) != 0) ++res.errors;
+        stats_.writes += res.writes;
+        stats_.bytes += res.bytes;
+        stats_.errors += res.errors;
+        synced = used;
+    }
+
+    // picks up after the last complete block of an existing file
+    void resume() {
+        struct stat st;
+        if(::fstat(fd, &st) != 0) return;
+        buffer_offset = st.st_size / static_cast<off_t>(alignment) * static_cast<off_t>(alignment);
+        auto tail = static_cast<size_t>(st.st_size - buffer_offset);
+        if(tail == 0) return;
+        // if it cannot be read back the partial block is overwritten
+        if(::pread(fd, buffers[active].get(), alignment, buffer_offset) < static_cast<ssize_t>(tail)) {
+            ++stats_.errors;
+            return;
+        }
+        used = synced = tail;
+    }
+
+    void output(const message_info& mi, const char* data, size_t size) override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(fd < 0) return;
+
+        if(used == synced) pending_since = std::chrono::steady_clock::now();
+        while(size > 0) {
+            auto chunk = std::min(size, capacity - used);
+            std::memcpy(buffers[active].get() + used, data, chunk);
+            used += chunk;
+            data += chunk;
+            size -= chunk;
+            if(used == capacity) {
+                ++stats_.size_flushes;
+                submit_full();
+            }
+        }
+
+        if(used == synced) return;
+        if(mi.level >= policy.immediate) {
+            ++stats_.level_flushes;
+            sync_tail();
+        } else if(policy.interval.count() > 0
+               && std::chrono::steady_clock::now() - pending_since >= policy.interval) {
+            ++stats_.interval_flushes;
+            sync_tail();
+        }
+    }
+
+public:
+    // buffers are policy.buffer_size each, rounded up to whole blocks
+    direct_file_sink(const std::string& filename, flush_policy policy = {}):
+        file_sink(open_direct(filename.c_str()), without_interval(policy)),
+        capacity(round_up(std::max(policy.buffer_size, size_t(alignment)))) {
+        buffers[0] = allocate(capacity);
+        buffers[1] = allocate(capacity);
+        if(fd < 0) return;
+        resume();
+        writer = std::thread([this]{ run(); });
+
+        // registered only now that flush_if_due can be called
+        this->policy.interval = policy.interval;
+        if(policy.interval.count() > 0) periodic_flusher::instance().add(this, policy.interval);
+    }
+
+    virtual ~direct_file_sink() {
+        if(policy.interval.count() > 0) periodic_flusher::instance().remove(this);
+        if(fd < 0) return;
+        {
+            std::lock_guard<std::mutex> lock(sink_mutex);
+            sync_tail();
+        }
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            done = true;
+        }
+        write_cv.notify_all();
+        writer.join();
+    }
+
+    void flush() override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(fd < 0 || used == synced) return;
+        ++stats_.explicit_flushes;
+        sync_tail();
+    }
+
+    void flush_if_due(std::chrono::steady_clock::time_point now) override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(used == synced || now - pending_since < policy.interval) return;
+        ++stats_.interval_flushes;
+        sync_tail();
+    }
+
+    // the policy only applies to the first request for a given file
+    static std::shared_ptr<sink> instance(const std::string& filename, flush_policy policy = {}) {
+        static std::unordered_map<std::string, std::shared_ptr<sink>> registry;
+        auto it = registry.find(filename);
+        if(it == registry.end()) {
+            return registry[filename] = std::make_shared<direct_file_sink>(filename, policy);
+        } else return it->second;
+    }
+};
+
+} /* namespace streamlogger */
+
+#endif // DIRECT_SINK_H
@@ -0,0 +1,130 @@
+#ifndef ESCAPE_H
+#define ESCAPE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#include <immintrin.h>
+#define STREAMLOGGER_HAS_SSE2 1
+#endif
+
+namespace streamlogger {
+namespace escape {
+
+// Bytes that need escaping are control characters, bytes of multi-byte UTF-8 sequences
+// (which have to be validated) and up to two more characters: '"' and '\\' for JSON,
+// DEL for plain text.
+struct specials {
+    char first;
+    char second;
+};
+
+constexpr specials json{ '"', '\\' };
+constexpr specials text{ '\x7f', '\x7f' };
+
+inline bool is_special(unsigned char ch, specials sp) {
+    return ch < 0x20 || ch >= 0x80 || ch == static_cast<unsigned char>(sp.first) || ch == static_cast<unsigned char>(sp.second);
+}
+
+inline size_t clean_run_scalar(const char* data, size_t size, specials sp) {
+    size_t i = 0;
+    while(i < size && not is_special(static_cast<unsigned char>(data[i]), sp)) ++i;
+    return i;
+}
+
+#ifdef STREAMLOGGER_HAS_SSE2
+// As signed bytes, everything at or above 0x80 is negative, so one signed compare
+// against 0x20 finds both control characters and non-ASCII bytes.
+inline size_t clean_run_sse2(const char* data, size_t size, specials sp) {
+    const auto space = _mm_set1_epi8(0x20);
+    const auto first = _mm_set1_epi8(sp.first);
+    const auto second = _mm_set1_epi8(sp.second);
+    size_t i = 0;
+    for(; i + 16 <= size; i += 16) {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        auto hit = _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_or_si128(_mm_cmpeq_epi8(v, first), _mm_cmpeq_epi8(v, second)));
+        auto mask = static_cast<unsigned>(_mm_movemask_epi8(hit));
+        if(mask != 0) return i + static_cast<size_t>(__builtin_ctz(mask));
+    }
+    return i + clean_run_scalar(data + i, size - i, sp);
+}
+
+__attribute__((target("avx2")))
+inline __m256i special_bytes_avx2(const char* data, __m256i space, __m256i first, __m256i second) {
+    auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+    return _mm256_or_si256(_mm256_cmpgt_epi8(space, v), _mm256_or_si256(_mm256_cmpeq_epi8(v, first), _mm256_cmpeq_epi8(v, second)));
+}
+
+// 64 bytes per iteration with a single test in the common (clean) case
+__attribute__((target("avx2")))
+inline size_t clean_run_avx2(const char* data, size_t size, specials sp) {
+    const auto space = _mm256_set1_epi8(0x20);
+    const auto first = _mm256_set1_epi8(sp.first);
+    const auto second = _mm256_set1_epi8(sp.second);
+    size_t i = 0;
+    for(; i + 64 <= size; i += 64) {
+        auto lo = special_bytes_avx2(data + i, space, first, second);
+        auto hi = special_bytes_avx2(data + i + 32, space, first, second);
+        auto any = _mm256_or_si256(lo, hi);
+        if(_mm256_testz_si256(any, any)) continue;
+        auto mask = static_cast<unsigned>(_mm256_movemask_epi8(lo));
+        if(mask != 0) return i + static_cast<size_t>(__builtin_ctz(mask));
+        return i + 32 + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(_mm256_movemask_epi8(hi))));
+    }
+    if(i + 32 <= size) {
+        auto mask = static_cast<unsigned>(_mm256_movemask_epi8(special_bytes_avx2(data + i, space, first, second)));
+        if(mask != 0) return i + static_cast<size_t>(__builtin_ctz(mask));
+        i += 32;
+    }
+    return i + clean_run_sse2(data + i, size - i, sp);
+}
+#endif
+
+using clean_run_fn = size_t (*)(const char*, size_t, specials);
+
+// the widest implementation this CPU runs, picked once
+inline clean_run_fn pick_clean_run() {
+#ifdef STREAMLOGGER_HAS_SSE2
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return &clean_run_avx2;
+    return &clean_run_sse2;
+#else
+    return &clean_run_scalar;
+#endif
+}
+
+// length of the leading run of data that can be copied as is
+inline size_t clean_run(const char* data, size_t size, specials sp) {
+    static const clean_run_fn fn = pick_clean_run();
+    return fn(data, size, sp);
+}
+
+// length of the well-formed UTF-8 sequence at data (2 to 4 bytes), or 0: overlong forms,
+// surrogates and code points past U+10FFFF are not well-formed
+inline size_t utf8_sequence(const char* data, size_t size) {
+    auto p = reinterpret_cast<const unsigned char*>(data);
+    auto cont = [&](size_t i) { return i < size && (p[i] & 0xc0) == 0x80; };
+    if(p[0] >= 0xc2 && p[0] <= 0xdf) return cont(1) ? 2 : 0;
+    if(p[0] >= 0xe0 && p[0] <= 0xef) {
+        if(not cont(1) || not cont(2)) return 0;
+        if(p[0] == 0xe0 && p[1] < 0xa0) return 0;
+        if(p[0] == 0xed && p[1] >= 0xa0) return 0;
+        return 3;
+    }
+    if(p[0] >= 0xf0 && p[0] <= 0xf4) {
+        if(not cont(1) || not cont(2) || not cont(3)) return 0;
+        if(p[0] == 0xf0 && p[1] < 0x90) return 0;
+        if(p[0] == 0xf4 && p[1] >= 0x90) return 0;
+        return 4;
+    }
+    return 0;
+}
+
+// U+FFFD, written in place of each byte that does not start a well-formed sequence
+constexpr const char* replacement = "\xef\xbf\xbd";
+
+} /* namespace escape */
+} /* namespace streamlogger */
+
+#endif // ESCAPE_H
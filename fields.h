@@ -0,0 +1,170 @@
+#ifndef FIELDS_H
+#define FIELDS_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "common.h"
+#include "binary_log.h"
+#include "buffer.h"
+
+namespace streamlogger {
+
+template<class T>
+struct kv_field {
+    essentials::string_view key;
+    const T& value;
+};
+
+// A typed field for logger::operator<<:
+//     log.info() << "request done" << kv("user_id", id) << kv("latency_us", t);
+// Built-in values are stored in binary and only formatted by the layout, on whichever
+// thread writes the record.
+template<class T>
+kv_field<T> kv(essentials::string_view key, const T& value) {
+    return { key, value };
+}
+
+// A record's fields, back to back:
+//   field := u32 key size, key, u8 binlog::arg_type, value encoded as in binary_log.h
+namespace fields {
+
+using binlog::arg_type;
+
+inline void put_key(buffer& out, essentials::string_view key, arg_type type) {
+    auto size = static_cast<std::uint32_t>(key.size());
+    out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.append(key);
+    out.append(static_cast<char>(type));
+}
+
+template<class T>
+void put(buffer& out, essentials::string_view key, arg_type type, T value) {
+    put_key(out, key, type);
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline void put_string(buffer& out, essentials::string_view key, essentials::string_view value) {
+    put_key(out, key, arg_type::STRING);
+    auto size = static_cast<std::uint32_t>(value.size());
+    out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.append(value);
+}
+
+// Calls f(key, type, in) for each field; f consumes exactly the value from in.
+template<class F>
+bool for_each(essentials::string_view kvs, F f) {
+    binlog::reader in(kvs.data(), kvs.size());
+    while(not in.done()) {
+        auto key = in.string();
+        auto type = static_cast<arg_type>(in.get<std::uint8_t>());
+        if(not in.ok()) return false;
+        f(key, type, in);
+        if(not in.ok()) return false;
+    }
+    return true;
+}
+
+// logfmt quoting: bare unless empty or containing spaces, quotes, '=' or control characters
+inline void append_logfmt_string(buffer& out, essentials::string_view sv) {
+    bool bare = not sv.empty();
+    for(char ch : sv) {
+        if(static_cast<unsigned char>(ch) <= ' ' || ch == '"' || ch == '=') {
+            bare = false;
+            break;
+        }
+    }
+    if(bare) {
+        out.append(sv);
+        return;
+    }
+    out.append('"');
+    out.append_json_escaped(sv);
+    out.append('"');
+}
+
+// Keys cannot be quoted in logfmt: every byte that is not printable ASCII, and '=' and
+// '"', becomes '_'. An empty key is written as "_".
+inline void append_logfmt_key(buffer& out, essentials::string_view key) {
+    if(key.empty()) out.append('_');
+    for(char ch : key) {
+        auto byte = static_cast<unsigned char>(ch);
+        out.append(byte > ' ' && byte < 0x7f && ch != '=' && ch != '"' ? ch : '_');
+    }
+}
+
+// one value as logfmt text
+inline void append_text(buffer& out, arg_type type, binlog::reader& in) {
+    switch(type) {
+        case arg_type::BOOL:
+            if(in.get<std::uint8_t>()) out.append("true", 4);
+            else out.append("false", 5);
+            break;
+        case arg_type::CHAR: {
+            char ch = in.get<char>();
+            append_logfmt_string(out, essentials::string_view(&ch, 1));
+            break;
+        }
+        case arg_type::STRING:
+            append_logfmt_string(out, in.string());
+            break;
+        default:
+            binlog::render_arg(type, in, out);
+            break;
+    }
+}
+
+// one value as JSON; non-finite numbers, characters and pointers become strings
+inline void append_json(buffer& out, arg_type type, binlog::reader& in) {
+    switch(type) {
+        case arg_type::INT:
+        case arg_type::UINT:
+            binlog::render_arg(type, in, out);
+            break;
+        case arg_type::DOUBLE: {
+            auto v = in.get<double>();
+            bool finite = std::isfinite(v);
+            if(not finite) out.append('"');
+            out.append_double(v);
+            if(not finite) out.append('"');
+            break;
+        }
+        case arg_type::BOOL:
+            if(in.get<std::uint8_t>()) out.append("true", 4);
+            else out.append("false", 5);
+            break;
+        case arg_type::CHAR: {
+            char ch = in.get<char>();
+            out.append('"');
+            out.append_json_escaped(essentials::string_view(&ch, 1));
+            out.append('"');
+            break;
+        }
+        case arg_type::STRING:
+            out.append('"');
+            out.append_json_escaped(in.string());
+            out.append('"');
+            break;
+        default:
+            out.append('"');
+            binlog::render_arg(type, in, out);
+            out.append('"');
+            break;
+    }
+}
+
+// " key=value" for every field
+inline void append_logfmt(buffer& out, essentials::string_view kvs) {
+    for_each(kvs, [&](essentials::string_view key, arg_type type, binlog::reader& in) {
+        out.append(' ');
+        append_logfmt_key(out, key);
+        out.append('=');
+        append_text(out, type, in);
+    });
+}
+
+} /* namespace fields */
+} /* namespace streamlogger */
+
+#endif // FIELDS_H
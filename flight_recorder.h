@@ -0,0 +1,194 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <atomic>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "sink.h"
+
+namespace streamlogger {
+
+// Keeps the most recent records in memory and writes nothing until it is asked to dump:
+// when a record at dump_level (FATAL by default) arrives, when a signal registered with
+// dump_on_signal() is delivered, or when dump() is called. A dump replaces the file with
+// the retained records, oldest first; once the ring has wrapped it starts at the first
+// complete line.
+class flight_recorder_sink: public sink {
+    static constexpr size_t max_recorders = 16;
+
+    std::unique_ptr<char[]> ring;
+    size_t capacity;
+    std::uint64_t written = 0;   // total bytes ever recorded
+    char path[PATH_MAX];
+    level dump_level;
+
+    void handle_start(const message_info&) override {}
+    void handle_end(const message_info&) override {}
+
+    static std::atomic<flight_recorder_sink*>* recorders() {
+        static std::atomic<flight_recorder_sink*> result[max_recorders];
+        return result;
+    }
+
+    // sink_mutex must be held
+    void append(const char* data, size_t size) {
+        if(size > capacity) {
+            written += size - capacity;
+            data += size - capacity;
+            size = capacity;
+        }
+        auto offset = static_cast<size_t>(written % capacity);
+        auto first = std::min(size, capacity - offset);
+        std::memcpy(ring.get() + offset, data, first);
+        std::memcpy(ring.get(), data + first, size - first);
+        written += size;
+    }
+
+    static bool write_all(int fd, const char* data, size_t size) {
+        while(size > 0) {
+            auto res = ::write(fd, data, size);
+            if(res < 0) {
+                if(errno == EINTR) continue;
+                return false;
+            }
+            data += res;
+            size -= static_cast<size_t>(res);
+        }
+        return true;
+    }
+
+    // only uses async-signal-safe calls
+    bool dump_to(const char* file) const {
+        int fd = ::open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0) return false;
+
+        auto total = written;
+        size_t size = static_cast<size_t>(std::min<std::uint64_t>(total, capacity));
+        size_t start = total > capacity ? static_cast<size_t>(total % capacity) : 0;
+        if(total > capacity) {
+            // the oldest record was partly overwritten
+            size_t skip = 0;
+            while(skip < size && ring[(start + skip) % capacity] != '\n') ++skip;
+            if(skip < size) ++skip;
+            start = (start + skip) % capacity;
+            size -= skip;
+        }
+
+        auto first = std::min(size, capacity - start);
+        bool ok = write_all(fd, ring.get() + start, first) && write_all(fd, ring.get(), size - first);
+        ::close(fd);
+        return ok;
+    }
+
+    // dispositions replaced by dump_on_signal(), by signal number
+    static struct sigaction* previous() {
+        static struct sigaction result[NSIG];
+        return result;
+    }
+
+    static bool ignored_by_default(int signo) {
+        switch(signo) {
+            case SIGCHLD: case SIGCONT: case SIGURG: case SIGWINCH: return true;
+            default: return false;
+        }
+    }
+
+    static void on_signal(int signo, siginfo_t* info, void* context) {
+        auto saved_errno = errno;
+        for(size_t i = 0; i < max_recorders; ++i) {
+            // no locking: the signal may have interrupted a thread holding sink_mutex
+            if(auto rec = recorders()[i].load(std::memory_order_acquire)) rec->dump_to(rec->path);
+        }
+        errno = saved_errno;
+
+        // then behave as if we were never here
+        auto&& old = previous()[signo];
+        if(old.sa_flags & SA_SIGINFO) {
+            if(old.sa_sigaction) old.sa_sigaction(signo, info, context);
+        } else if(old.sa_handler == SIG_IGN) {
+            return;
+        } else if(old.sa_handler == SIG_DFL) {
+            if(ignored_by_default(signo)) return;
+            // terminate (and dump core) as the default action would; the signal stays
+            // blocked until the handler returns, faults simply happen again
+            ::sigaction(signo, &old, nullptr);
+            ::raise(signo);
+        } else {
+            old.sa_handler(signo);
+        }
+    }
+
+    void output(const message_info& mi, const char* data, size_t size) override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        append(data, size);
+        if(mi.level >= dump_level) dump_to(path);
+    }
+
+public:
+    flight_recorder_sink(const std::string& dump_path, size_t capacity = 8 << 20, level dump_level = level::FATAL):
+        sink(),
+        ring(new char[std::max<size_t>(capacity, 1)]),
+        capacity(std::max<size_t>(capacity, 1)),
+        dump_level(dump_level) {
+        std::strncpy(path, dump_path.c_str(), sizeof(path) - 1);
+        path[sizeof(path) - 1] = 0;
+        for(size_t i = 0; i < max_recorders; ++i) {
+            flight_recorder_sink* expected = nullptr;
+            if(recorders()[i].compare_exchange_strong(expected, this)) break;
+        }
+    }
+
+    virtual ~flight_recorder_sink() {
+        for(size_t i = 0; i < max_recorders; ++i) {
+            flight_recorder_sink* expected = this;
+            if(recorders()[i].compare_exchange_strong(expected, nullptr)) break;
+        }
+    }
+
+    // writes the retained records to the dump path
+    bool dump() {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        return dump_to(path);
+    }
+
+    bool dump(const std::string& file) {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        return dump_to(file.c_str());
+    }
+
+    // nothing is written until a dump
+    void flush() override {}
+
+    // Every flight_recorder_sink dumps when signo arrives, then the disposition that was
+    // in place before is honoured: a previous handler is called, an ignored signal stays
+    // ignored, and the default action (terminating the process for SIGTERM, SIGINT,
+    // SIGSEGV, ...) still happens. Dumps from a signal are best effort: they do not lock
+    // against concurrent writers.
+    static void dump_on_signal(int signo) {
+        if(signo <= 0 || signo >= NSIG) return;
+        struct sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        action.sa_sigaction = &flight_recorder_sink::on_signal;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART | SA_SIGINFO;
+
+        struct sigaction old;
+        if(::sigaction(signo, &action, &old) != 0) return;
+        // registering twice must not make the recorder its own predecessor
+        if(not ((old.sa_flags & SA_SIGINFO) && old.sa_sigaction == &flight_recorder_sink::on_signal)) {
+            previous()[signo] = old;
+        }
+    }
+};
+
+} /* namespace streamlogger */
+
+#endif // FLIGHT_RECORDER_H
@@ -3,132 +3,154 @@
 
 #include <sstream>
 #include <vector>
-#include <functional>
-#include <iomanip>
-#include <regex>
+#include <cstdint>
 #include <chrono>
 
-#include "lib/date/date.h"
-
 #include "common.h"
+#include "buffer.h"
+#include "fields.h"
+#include "timestamp.h"
 #include "sink.h"
 
 namespace streamlogger {
 
 class pattern {
 
-    using outputter = std::function<void(sink&, const message_info&)>;
-
-    std::vector<outputter> pre;
-    std::vector<outputter> post;
-
-    static outputter putLiteral(const std::string& s) {
-        return [s](sink& ostr, const message_info&) {
-            ostr << s;
-        };
-    }
-
-    static outputter putPercent() {
-        return [](sink& ostr, const message_info&) {
-            ostr << '%';
-        };
-    }
-
-    static constexpr int abs(int v) { return v < 0 ? -v : v; } 
-
-    static void handleMinWidth(sink& ostr, int min_width) {
-        if(min_width > 0) ostr << std::left;
-        if(min_width != 0) ostr << std::setw(abs(min_width));
-    }
-    static void writeString(sink& ostr, ::essentials::string_view sv, int min_width, unsigned max_width) {
-        handleMinWidth(ostr, min_width);
-        if(max_width != 0) {
-            ostr << sv.substr(0, max_width);
-        } else ostr << sv;
-    }
-
-    static outputter putCategory(int min_width, unsigned max_width, const std::string&) {
-        return [min_width, max_width](sink& ostr, const message_info& mi) {
-            writeString(ostr, mi.category, min_width, max_width);
-        };
-    }
-
-    static outputter putCaller(int min_width, unsigned max_width, const std::string&) {
-        return [min_width, max_width](sink& ostr, const message_info& mi) {
-            writeString(ostr, mi.caller, min_width, max_width);
-        };
+    enum class opcode: std::uint8_t {
+        LITERAL,
+        CATEGORY,
+        CALLER,
+        DATE,
+        FILENAME,
+        LINENUMBER,
+        LOCATION,
+        PRIORITY
+    };
+
+    struct instruction {
+        opcode op;
+        bool left;           // pad after the value instead of before it
+        std::uint16_t width; // minimum width
+        std::uint32_t max_width;
+        // LITERAL: text in the literal pool, DATE: index into dates
+        std::uint32_t offset;
+        std::uint32_t length;
+    };
+
+    using program = std::vector<instruction>;
+
+    std::string literals;
+    std::vector<timestamp_format> dates;
+    program pre;
+    program post;
+
+    static constexpr int abs(int v) { return v < 0 ? -v : v; }
+
+    void emitLiteral(program& prog, essentials::string_view sv) {
+        if(sv.empty()) return;
+        auto offset = static_cast<std::uint32_t>(literals.size());
+        literals.append(sv.data(), sv.size());
+        // merge with the previous literal if it ends right where this one starts
+        if(not prog.empty() && prog.back().op == opcode::LITERAL && prog.back().offset + prog.back().length == offset) {
+            prog.back().length += static_cast<std::uint32_t>(sv.size());
+            return;
+        }
+        prog.push_back(instruction{ opcode::LITERAL, false, 0, 0, offset, static_cast<std::uint32_t>(sv.size()) });
     }
 
-    static outputter putDate(int min_width, unsigned max_width, const std::string& postfix) {
-        return [min_width, max_width, postfix](sink& ostr, const message_info& mi) {
-            auto pfix = postfix;
-            if(pfix.empty()) pfix = "%F %T";
-            handleMinWidth(ostr, min_width);
-            ostr << date::format(pfix, std::chrono::system_clock::now() + util::local_tz_offset());
-        };
+    void emit(program& prog, opcode op, int min_width, unsigned max_width, essentials::string_view arg = "") {
+        auto offset = static_cast<std::uint32_t>(literals.size());
+        literals.append(arg.data(), arg.size());
+        prog.push_back(instruction{
+            op,
+            min_width > 0,
+            static_cast<std::uint16_t>(abs(min_width)),
+            static_cast<std::uint32_t>(max_width),
+            offset,
+            static_cast<std::uint32_t>(arg.size())
+        });
     }
 
-    static outputter putFilename(int min_width, unsigned max_width, const std::string&) {
-        return [min_width, max_width](sink& ostr, const message_info& mi) {
-            writeString(ostr, mi.caller_location.file, min_width, max_width);
-        };
+    static void pad(buffer& out, size_t width, size_t size) {
+        if(width > size) out.append(width - size, ' ');
     }
 
-    static outputter putLinenumber(int min_width, unsigned max_width, const std::string&) {
-        return [min_width, max_width](sink& ostr, const message_info& mi) {
-            handleMinWidth(ostr, min_width);
-            ostr << mi.caller_location.line ;
-        };
+    // pads what was written since start to the minimum width
+    static void align(buffer& out, size_t start, const instruction& ins) {
+        auto size = out.size() - start;
+        if(ins.width > size) {
+            if(ins.left) out.append(ins.width - size, ' ');
+            else out.insert(start, ins.width - size, ' ');
+        }
     }
 
-    static outputter putLinefeed(int min_width, unsigned max_width, const std::string& postfix) {
-        return [min_width, max_width](sink& ostr, const message_info& mi) {
-            handleMinWidth(ostr, min_width);
-            ostr << '\n';
-        };
+    // category and caller names may come from anywhere, so control characters and
+    // ill-formed UTF-8 are escaped; max_width applies to the escaped text, which is cut
+    // before an escape or a code point that does not fit
+    static void writeString(buffer& out, essentials::string_view sv, const instruction& ins) {
+        auto start = out.size();
+        out.append_sanitized(sv, ins.max_width == 0 ? ~size_t(0) : ins.max_width);
+        align(out, start, ins);
     }
 
-    static outputter putLocation(int min_width, unsigned max_width, const std::string& postfix) {
-        return [min_width, max_width](sink& ostr, const message_info& mi) {
-            std::stringstream locus;
-            locus << mi.caller_location.file
-                  << ":" << mi.caller_location.line
-                  << ":" << mi.caller_location.col << std::flush;
-
-            handleMinWidth(ostr, min_width);
-            ostr << locus.rdbuf();
-        };
+    // writes v right-aligned into the characters before end, returns the start
+    static char* formatUnsigned(char* end, size_t v) {
+        do {
+            *--end = static_cast<char>('0' + v % 10);
+            v /= 10;
+        } while(v != 0);
+        return end;
     }
 
-    static outputter putPriority(int min_width, unsigned max_width, const std::string& postfix) {
-        return [min_width, max_width](sink& ostr, const message_info& mi) {
-            const char* prio;
-            switch(mi.level) {
-                case level::ALL:
-                    prio = "ALL";
+    void run(const program& prog, buffer& out, const message_info& mi) const {
+        for(auto&& ins : prog) {
+            switch(ins.op) {
+                case opcode::LITERAL:
+                    out.append(literals.data() + ins.offset, ins.length);
                     break;
-                case level::TRACE:
-                    prio = "TRACE";
+                case opcode::CATEGORY:
+                    writeString(out, mi.category, ins);
                     break;
-                case level::DEBUG:
-                    prio = "DEBUG";
+                case opcode::CALLER:
+                    writeString(out, mi.caller, ins);
                     break;
-                case level::INFO:
-                    prio = "INFO";
+                case opcode::DATE: {
+                    auto start = out.size();
+                    dates[ins.offset].render(out, clock::to_time_point(mi.time_point));
+                    align(out, start, ins);
                     break;
-                case level::WARN:
-                    prio = "WARN";
+                }
+                case opcode::FILENAME:
+                    writeString(out, mi.caller_location.file, ins);
                     break;
-                case level::ERROR:
-                    prio = "ERROR";
+                case opcode::LINENUMBER: {
+                    char digits[24];
+                    auto end = digits + sizeof(digits);
+                    auto begin = formatUnsigned(end, mi.caller_location.line);
+                    auto size = static_cast<size_t>(end - begin);
+                    if(not ins.left) pad(out, ins.width, size);
+                    out.append(begin, size);
+                    if(ins.left) pad(out, ins.width, size);
                     break;
-                case level::FATAL:
-                    prio = "FATAL";
+                }
+                case opcode::LOCATION: {
+                    char digits[48];
+                    auto end = digits + sizeof(digits);
+                    auto begin = formatUnsigned(end, mi.caller_location.col);
+                    *--begin = ':';
+                    begin = formatUnsigned(begin, mi.caller_location.line);
+                    *--begin = ':';
+                    auto start = out.size();
+                    out.append_sanitized(mi.caller_location.file);
+                    out.append(begin, static_cast<size_t>(end - begin));
+                    align(out, start, ins);
+                    break;
+                }
+                case opcode::PRIORITY:
+                    writeString(out, priorityName(mi.level), ins);
                     break;
             }
-
-            writeString(ostr, prio, min_width, max_width);
-        };
+        }
     }
 
     pattern() = default;
@@ -137,13 +159,27 @@ public:
     pattern(const pattern&) = default;
     pattern(pattern&&) = default;
 
+    static const char* priorityName(level lvl) {
+        switch(lvl) {
+            case level::ALL: return "ALL";
+            case level::TRACE: return "TRACE";
+            case level::DEBUG: return "DEBUG";
+            case level::INFO: return "INFO";
+            case level::WARN: return "WARN";
+            case level::ERROR: return "ERROR";
+            case level::FATAL: return "FATAL";
+        }
+        return "";
+    }
+
+    // compiles rep into flat prefix/suffix programs over a shared literal pool
     static pattern parse(const std::string& rep) {
         std::istringstream istr(rep);
 
         bool messageDone = false;
         pattern pat;
 
-        auto toInsert = [&]()-> std::vector<outputter>& { return messageDone? pat.post : pat.pre; };
+        auto toInsert = [&]()-> program& { return messageDone? pat.post : pat.pre; };
 
         std::string literal;
         std::string postfix;
@@ -151,21 +187,22 @@ public:
         unsigned max_width = 0;
 
         while(istr) {
+            literal.clear();
             std::getline(istr, literal, '%');
-            toInsert().push_back(putLiteral(literal));
+            pat.emitLiteral(toInsert(), literal);
             if(istr.eof()) break;
 
             char ch;
             istr.get(ch);
 
             if(ch == '%') {
-                toInsert().push_back(putPercent());
+                pat.emitLiteral(toInsert(), "%");
                 continue;
             }
 
             // preamble '-'?[0-9]*'.'?[0-9]*
             min_width = 0;
-            if(ch == '-' || ('0' < ch && ch < '9')) {
+            if(ch == '-' || ('0' <= ch && ch <= '9')) {
                 istr.putback(ch);
                 istr >> min_width;
                 istr.get(ch);
@@ -180,110 +217,162 @@ public:
             char code = ch;
 
             postfix = "";
-            istr.get(ch);
-            if(ch == '{') {
-                getline(istr, postfix, '}');
-            } else {
-                istr.putback(ch);
-            }
+            if(istr.get(ch)) {
+                if(ch == '{') {
+                    getline(istr, postfix, '}');
+                } else {
+                    istr.putback(ch);
+                }
+            } else istr.clear(std::ios::eofbit);
 
             switch(code) {
                 case 'c': {
-                    toInsert().push_back(putCategory(min_width, max_width, postfix));
+                    pat.emit(toInsert(), opcode::CATEGORY, min_width, max_width);
                     break;
                 }
-                case 'C': {
-                    toInsert().push_back(putCaller(min_width, max_width, postfix));
+                case 'C':
+                case 'M': {
+                    pat.emit(toInsert(), opcode::CALLER, min_width, max_width);
                     break;
                 }
                 case 'd': {
-                    toInsert().push_back(putDate(min_width, max_width, postfix));
+                    pat.emit(toInsert(), opcode::DATE, min_width, max_width);
+                    toInsert().back().offset = static_cast<std::uint32_t>(pat.dates.size());
+                    pat.dates.emplace_back(postfix.empty() ? "%F %T" : postfix);
                     break;
                 }
                 case 'p': {
-                    toInsert().push_back(putPriority(min_width, max_width, postfix));
+                    pat.emit(toInsert(), opcode::PRIORITY, min_width, max_width);
                     break;
                 }
                 case 'F': {
-                    toInsert().push_back(putFilename(min_width, max_width, postfix));
+                    pat.emit(toInsert(), opcode::FILENAME, min_width, max_width);
                     break;
                 }
                 case 'l': {
-                    toInsert().push_back(putLocation(min_width, max_width, postfix));
+                    pat.emit(toInsert(), opcode::LOCATION, min_width, max_width);
                     break;
                 }
                 case 'L': {
-                    toInsert().push_back(putLinenumber(min_width, max_width, postfix));
+                    pat.emit(toInsert(), opcode::LINENUMBER, min_width, max_width);
                     break;
                 }
                 case 'm': {
                     messageDone = true;
                     break;
                 }
-                case 'M': {
-                    toInsert().push_back(putCaller(min_width, max_width, postfix));
-                }
                 case 'n': {
-                    toInsert().push_back(putLinefeed(min_width, max_width, postfix));
+                    pat.emitLiteral(toInsert(), "\n");
+                    break;
                 }
                 default: throw std::runtime_error("Incorrect pattern specified: " + rep);
             }
         }
 
-        return std::move(pat);
+        return pat;
     }
 
-    void print_prefix(sink& ost, const message_info* mi) {
-        for(auto&& f : pre) {
-            f(ost, *mi);
-        }
+    void print_prefix(buffer& out, const message_info* mi) const {
+        run(pre, out, *mi);
     }
 
-    void print_suffix(sink& ost, const message_info* mi) {
-        for(auto&& f : post) {
-            f(ost, *mi);
-        }
+    void print_suffix(buffer& out, const message_info* mi) const {
+        run(post, out, *mi);
+    }
+
+};
+
+// Turns a record into the bytes handed to a sink.
+class layout {
+public:
+    virtual ~layout() {}
+    // fields: the record's kv() fields, see fields.h
+    virtual void format(buffer& out, const message_info& mi, essentials::string_view body, essentials::string_view fields) const = 0;
+};
+
+// the message is followed by " key=value" for each field
+class pattern_layout: public layout {
+    pattern pattern_;
+public:
+    explicit pattern_layout(const std::string& pstring): pattern_(pattern::parse(pstring)) {}
+
+    void format(buffer& out, const message_info& mi, essentials::string_view body, essentials::string_view kvs) const override {
+        pattern_.print_prefix(out, &mi);
+        out.append(body);
+        if(not kvs.empty()) fields::append_logfmt(out, kvs);
+        pattern_.print_suffix(out, &mi);
     }
+};
+
+// One JSON object per line, with the time in UTC:
+//     {"time":"2024-01-02T03:04:05.678901234Z","level":"INFO","category":"net","message":"done","user_id":42}
+// Field values keep their JSON type.
+class json_layout: public layout {
+    timestamp_format time_format{ "%FT%TZ", 9, timestamp_format::zone::UTC };
+public:
+    void format(buffer& out, const message_info& mi, essentials::string_view body, essentials::string_view kvs) const override {
+        out.append("{\"time\":\"", 9);
+        time_format.render(out, clock::to_time_point(mi.time_point));
+        out.append("\",\"level\":\"", 11);
+        out.append(pattern::priorityName(mi.level));
+        out.append("\",\"category\":\"", 14);
+        out.append_json_escaped(mi.category);
+        out.append("\",\"message\":\"", 13);
+        out.append_json_escaped(body);
+        out.append('"');
+        fields::for_each(kvs, [&](essentials::string_view key, fields::arg_type type, binlog::reader& in) {
+            out.append(",\"", 2);
+            out.append_json_escaped(key);
+            out.append("\":", 2);
+            fields::append_json(out, type, in);
+        });
+        out.append("}\n", 2);
+    }
+};
 
+// One logfmt line, with the time in UTC:
+//     time=2024-01-02T03:04:05.678901234Z level=INFO category=net msg=done user_id=42
+class logfmt_layout: public layout {
+    timestamp_format time_format{ "%FT%TZ", 9, timestamp_format::zone::UTC };
+public:
+    void format(buffer& out, const message_info& mi, essentials::string_view body, essentials::string_view kvs) const override {
+        out.append("time=", 5);
+        time_format.render(out, clock::to_time_point(mi.time_point));
+        out.append(" level=", 7);
+        out.append(pattern::priorityName(mi.level));
+        out.append(" category=", 10);
+        fields::append_logfmt_string(out, mi.category);
+        out.append(" msg=", 5);
+        fields::append_logfmt_string(out, body);
+        fields::append_logfmt(out, kvs);
+        out.append('\n');
+    }
 };
 
 class formatter {
     std::shared_ptr<sink> sink_;
-    pattern pattern;
+    std::unique_ptr<layout> layout_;
     level threshold = level::TRACE;
-    bool skip = false;
 public:
     formatter(std::shared_ptr<sink> sink, const std::string& pstring, level threshold = level::ALL)
-        : sink_(sink), pattern(pattern::parse(pstring)), threshold(threshold) {}
+        : sink_(sink), layout_(new pattern_layout(pstring)), threshold(threshold) {}
 
-    formatter& operator<<(const message_start& ms) {
-        skip = ms.info->level < threshold;
-        if(not skip) {
-            (*sink_) << ms;
-            pattern.print_prefix(*sink_, ms.info);
-        }
-        return *this;
-    }
+    formatter(std::shared_ptr<sink> sink, std::unique_ptr<layout> lay, level threshold = level::ALL)
+        : sink_(sink), layout_(std::move(lay)), threshold(threshold) {}
 
-    formatter& operator<<(const message_end& ms) {
-        if(not skip) {
-            pattern.print_suffix(*sink_, ms.info);
-            (*sink_) << ms;
-        }
-        return *this;
+    // renders the record into out and hands the result to the sink in one piece
+    void write(buffer_stream& out, const message_info& mi, essentials::string_view body, essentials::string_view kvs = {}) {
+        if(mi.level < threshold) return;
+
+        layout_->format(out.buf(), mi, body, kvs);
+        sink_->write(mi, out.view());
     }
 
-    template<
-        class T,
-        class = std::enable_if_t<
-               not std::is_same<std::decay_t<T>, message_start>::value
-            && not std::is_same<std::decay_t<T>, message_end>::value
-        >
-    >
-    formatter& operator<<(T&& value) {
-        if(not skip) (*sink_) << std::forward<T>(value);
-        return *this;
+    void flush() {
+        sink_->flush();
     }
+
+    level get_threshold() const { return threshold; }
 };
 
 } /* namespace streamlogger */
@@ -0,0 +1,16 @@
+#pragma once
+#include <experimental/string_view>
+#include <string>
+namespace essentials {
+template<class C, class T = std::char_traits<C>>
+struct basic_string_view: std::experimental::basic_string_view<C, T> {
+    using base = std::experimental::basic_string_view<C, T>;
+    using base::base;
+    basic_string_view(base b): base(b) {}
+    basic_string_view(const std::basic_string<C, T>& s): base(s) {}
+    basic_string_view substr(size_t p = 0, size_t n = base::npos) const { return base::substr(p, n); }
+    operator std::basic_string<C, T>() const { return std::basic_string<C, T>(this->data(), this->size()); }
+    std::basic_string<C, T> to_string() const { return *this; }
+};
+using string_view = basic_string_view<char>;
+}
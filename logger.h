@@ -1,40 +1,148 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include <cstring>
+#include <string>
+#include <type_traits>
+
 #include "common.h"
+#include "buffer.h"
+#include "fields.h"
+#include "timestamp.h"
 #include "multiplexer.h"
+#include "async.h"
 
 namespace streamlogger {
 
+namespace detail {
+
+struct integer_value {};
+struct floating_value {};
+struct char_value {};
+struct string_value {};
+struct pointer_value {};
+struct other_value {};
+
+template<class T>
+using value_kind = std::conditional_t<
+    std::is_same<T, char>::value || std::is_same<T, signed char>::value || std::is_same<T, unsigned char>::value, char_value,
+    std::conditional_t<std::is_integral<T>::value && sizeof(T) <= sizeof(std::uint64_t)
+        && not std::is_same<T, wchar_t>::value && not std::is_same<T, char16_t>::value && not std::is_same<T, char32_t>::value, integer_value,
+    std::conditional_t<std::is_same<T, float>::value || std::is_same<T, double>::value, floating_value,
+    std::conditional_t<std::is_same<T, const char*>::value || std::is_same<T, char*>::value
+        || std::is_same<T, std::string>::value || std::is_same<T, essentials::string_view>::value, string_value,
+    std::conditional_t<std::is_pointer<T>::value && not std::is_function<std::remove_pointer_t<T>>::value, pointer_value,
+    other_value>>>>>;
+
+template<class T>
+void write_value(buffer_stream& out, const T& value, integer_value) { out.buf().append_integer(value); }
+inline void write_value(buffer_stream& out, double value, floating_value) { out.buf().append_double(value); }
+inline void write_value(buffer_stream& out, float value, floating_value) { out.buf().append_float(value); }
+inline void write_value(buffer_stream& out, char value, char_value) { out.buf().append(value); }
+inline void write_value(buffer_stream& out, essentials::string_view value, string_value) { out.buf().append(value); }
+inline void write_value(buffer_stream& out, const void* value, pointer_value) { out.buf().append_pointer(value); }
+
+inline void write_value(buffer_stream& out, const char* value, string_value) {
+    if(value) out.buf().append(value, std::strlen(value));
+    else out.setstate(std::ios_base::badbit); // as std::ostream does
+}
+
+template<class T>
+void write_value(buffer_stream& out, const T& value, other_value) { out << value; }
+
+// built-in types go straight into the buffer unless a manipulator changed the stream's
+// formatting; everything else, including user types, goes through std::ostream
+template<class T>
+void write_value(buffer_stream& out, const T& value) {
+    using kind = value_kind<std::decay_t<T>>;
+    if(std::is_same<kind, other_value>::value || not out.plain()) out << value;
+    else write_value(out, value, kind{});
+}
+
+// kv() values keep their type; user types are rendered to a string here
+template<class T>
+void write_field(buffer& out, essentials::string_view key, const T& value, integer_value) {
+    if(std::is_signed<T>::value) fields::put(out, key, fields::arg_type::INT, static_cast<std::int64_t>(value));
+    else fields::put(out, key, fields::arg_type::UINT, static_cast<std::uint64_t>(value));
+}
+inline void write_field(buffer& out, essentials::string_view key, bool value, integer_value) {
+    fields::put(out, key, fields::arg_type::BOOL, static_cast<std::uint8_t>(value));
+}
+inline void write_field(buffer& out, essentials::string_view key, double value, floating_value) {
+    fields::put(out, key, fields::arg_type::DOUBLE, value);
+}
+inline void write_field(buffer& out, essentials::string_view key, char value, char_value) {
+    fields::put(out, key, fields::arg_type::CHAR, value);
+}
+inline void write_field(buffer& out, essentials::string_view key, essentials::string_view value, string_value) {
+    fields::put_string(out, key, value);
+}
+inline void write_field(buffer& out, essentials::string_view key, const char* value, string_value) {
+    fields::put_string(out, key, value ? essentials::string_view(value) : essentials::string_view());
+}
+inline void write_field(buffer& out, essentials::string_view key, const void* value, pointer_value) {
+    fields::put(out, key, fields::arg_type::POINTER, static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(value)));
+}
+template<class T>
+void write_field(buffer& out, essentials::string_view key, const T& value, other_value) {
+    auto text = buffer_stream::acquire();
+    *text << value;
+    fields::put_string(out, key, text->view());
+}
+
+template<class T>
+void write_field(buffer& out, const kv_field<T>& field) {
+    write_field(out, field.key, field.value, value_kind<std::decay_t<T>>{});
+}
+
+} /* namespace detail */
+
 class logger {
-    const std::string &category_;
-    level level_;
     std::shared_ptr<multiplexer> multiplexer_;
     message_info mi;
-    bool initialized = false;
+    bool flush_requested = false;
+    // the message body, assembled in a thread-local buffer
+    buffer_stream::ptr body_;
+    // kv() fields, see fields.h
+    buffer_stream::ptr fields_;
+
+    template<class T>
+    void append(const T& value) {
+        if(not body_) body_ = buffer_stream::acquire();
+        detail::write_value(*body_, value);
+    }
+
+    template<class T>
+    void append(const kv_field<T>& field) {
+        if(not fields_) fields_ = buffer_stream::acquire();
+        detail::write_field(fields_->buf(), field);
+    }
 
 public:
-    logger(const std::string &category,
+    // category, caller and location->file must outlive the record (interned names or literals)
+    logger(const char *category,
            level level,
            std::shared_ptr<multiplexer> multiplexer,
            const char *caller,
            const location *location) :
-        category_(category),
-        level_(level),
-        multiplexer_(multiplexer),
+        multiplexer_(std::move(multiplexer)),
         mi{} {
-        mi.category = category_;
-        mi.level = level_;
+        if (not multiplexer_) return; // disabled: nothing will be written
+
+        mi.category = category;
+        mi.level = level;
+        mi.time_point = clock::now();
         if (caller) mi.caller = caller;
         if (location) mi.caller_location = *location;
+        if (multiplexer_->async()) mi.thread_id = std::this_thread::get_id();
     }
 
     logger(logger&& that):
-        category_(std::move(that.category_)),
-        level_(that.level_),
         multiplexer_(std::move(that.multiplexer_)),
-        mi(std::move(that.mi)),
-        initialized(that.initialized) {
+        mi(that.mi),
+        flush_requested(that.flush_requested),
+        body_(std::move(that.body_)),
+        fields_(std::move(that.fields_)) {
 
         that.multiplexer_ = nullptr; // just to be sure
     }
@@ -43,24 +151,44 @@ public:
     logger& operator=(const logger&) = delete;
 
     ~logger() {
-        if(multiplexer_ && initialized) (*multiplexer_) << message_end{&mi};
+        if(not multiplexer_ || (not body_ && not fields_)) return;
+
+        auto body = body_ ? body_->view() : essentials::string_view();
+        auto kvs = fields_ ? fields_->view() : essentials::string_view();
+        if(auto async = multiplexer_->async()) {
+            async->push(std::move(multiplexer_), mi, body, kvs, flush_requested);
+            return;
+        }
+        multiplexer_->write(mi, body, kvs);
+        if(flush_requested) multiplexer_->flush();
     }
 
     template <class T>
     logger& operator<<(T&& value) {
-        if(not initialized) (*multiplexer_) << message_start{&mi};
-        initialized = true;
-
-        (*multiplexer_) << std::forward<T>(value);
+        if(not multiplexer_) return *this;
+        append(value);
         return *this;
     }
 
     void flush() {
-        (*multiplexer_) << static_cast<std::add_pointer_t<std::ostream&(std::ostream&)>>(std::flush);
+        if(not multiplexer_) return;
+        if(body_ || fields_) flush_requested = true;
+        else if(not multiplexer_->async()) multiplexer_->flush();
     }
 
 };
 
+// stands in for logger when the level is compiled out
+struct null_logger {
+    template <class T>
+    null_logger& operator<<(T&&) { return *this; }
+
+    void flush() {}
+};
+
+template<level L>
+using level_logger = std::conditional_t<level_enabled<L>::value, logger, null_logger>;
+
 } /* namespace streamlogger */
 
 #endif // LOGGER_H
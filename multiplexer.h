@@ -4,19 +4,62 @@
 #include "common.h"
 #include "formatter.h"
 
+#include <memory>
+#include <mutex>
+#include <vector>
+
 namespace streamlogger {
 
+class async_dispatcher;
+
 class multiplexer {
     std::vector<std::shared_ptr<formatter>> formatters;
+    async_dispatcher* async_ = nullptr;
+    // set by create(); lock() fails once the multiplexer has been retired
+    std::weak_ptr<multiplexer> self;
 
     friend class category;
+
+    // Categories publish multiplexers through a raw pointer, so a reader may be about
+    // to lock() one that has just been replaced. Their memory is therefore never freed:
+    // the last reference only releases the formatters (and the sinks only they hold),
+    // and the empty shell stays reachable from here.
+    static void retire(multiplexer* m) {
+        m->formatters.clear();
+        static auto retired = new std::vector<std::unique_ptr<multiplexer>>();
+        static auto retired_mutex = new std::mutex();
+        std::lock_guard<std::mutex> lock(*retired_mutex);
+        retired->emplace_back(m);
+    }
+
+    static std::shared_ptr<multiplexer> create(multiplexer&& from) {
+        std::shared_ptr<multiplexer> res(new multiplexer(std::move(from)), &retire);
+        res->self = res;
+        return res;
+    }
 public:
-    template<class T>
-    multiplexer& operator<<(T&& value) {
+    multiplexer() = default;
+    multiplexer(const multiplexer& that): formatters(that.formatters), async_(that.async_) {}
+    multiplexer(multiplexer&&) = default;
+
+    // a new reference, or null if this multiplexer has been retired meanwhile
+    std::shared_ptr<multiplexer> lock() const { return self.lock(); }
+    // non-null when records for this multiplexer are handed to a background thread
+    async_dispatcher* async() const { return async_; }
+
+    // fields: the record's kv() fields, see fields.h
+    void write(const message_info& mi, essentials::string_view body, essentials::string_view fields = {}) {
+        auto record = buffer_stream::acquire();
+        for(auto&& f : formatters) {
+            record->reset();
+            f->write(*record, mi, body, fields);
+        }
+    }
+
+    void flush() {
         for(auto&& f : formatters) {
-            (*f) << value;
+            f->flush();
         }
-        return *this;
     }
 };
 
@@ -0,0 +1,277 @@
+#ifndef RING_H
+#define RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "common.h"
+
+namespace streamlogger {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "byte_ring needs lock-free atomics, it may live in memory shared between processes");
+
+// A multi-producer, single-consumer ring of variable-sized records over caller-provided
+// memory, which may be shared between processes. Producers reserve space by advancing a
+// shared position (a CAS that fails when full, or a fetch_add that waits for space), copy
+// their record without a lock and publish it by storing its header.
+// The consumer releases records strictly in reservation order. A producer that stops
+// between reserving and committing holds back everything after it until its process is
+// found to be dead; then its record is skipped and counted as dropped. Only a producer
+// killed within the few instructions between reserving and claiming its header (or while
+// waiting for space in write()) cannot be skipped, as the size of its record is unknown.
+class byte_ring {
+public:
+    struct control {
+        std::atomic<std::uint64_t> reserved;   // end of the last reservation
+        char pad0[64 - sizeof(std::atomic<std::uint64_t>)];
+        std::atomic<std::uint64_t> released;   // everything before this is free again
+        char pad1[64 - sizeof(std::atomic<std::uint64_t>)];
+        std::atomic<std::uint64_t> dropped;    // records that did not fit or were abandoned
+        std::uint64_t capacity;
+        std::atomic<std::uint32_t> ready;      // ready_magic once the control block is initialised
+        std::uint32_t version;                 // layout_version of whoever initialised it
+    };
+
+    static constexpr std::uint32_t layout_version = 2;
+
+private:
+    // Precedes every record. length is 0 until the producer claims the header with the
+    // record's size (and its pid in owner), then gets the committed bit.
+    struct record_header {
+        std::atomic<std::uint32_t> length;
+        std::uint32_t tag;
+        std::int32_t owner;
+        std::uint32_t unused;
+    };
+
+    static constexpr std::uint32_t committed = 1u << 31;
+    static constexpr std::uint32_t claimed = 1u << 30;
+    static constexpr std::uint32_t ready_magic = 0x534c5247; // "SLRG"
+
+    // how long the consumer waits on an uncommitted record before checking its owner
+    static std::chrono::milliseconds stall_check() { return std::chrono::milliseconds(10); }
+
+    control* ctl;
+    char* data;
+    std::uint64_t mask;
+    std::string scratch; // consumer side, for records split by the end of the ring
+    std::uint64_t stalled_pos = ~std::uint64_t(0);
+    std::chrono::steady_clock::time_point stalled_since;
+
+    // getpid() without a system call per record; refreshed in forked children
+    static pid_t& cached_pid() {
+        static pid_t result = []{
+            ::pthread_atfork(nullptr, nullptr, []{ cached_pid() = ::getpid(); });
+            return ::getpid();
+        }();
+        return result;
+    }
+
+    // whole headers, so that a header never straddles the end of the ring
+    static std::uint64_t aligned(std::uint64_t size) {
+        return (size + sizeof(record_header) - 1) & ~std::uint64_t(sizeof(record_header) - 1);
+    }
+
+    record_header* header_at(std::uint64_t pos) const {
+        return reinterpret_cast<record_header*>(data + (pos & mask));
+    }
+
+    void copy_in(std::uint64_t pos, const char* src, size_t size) {
+        if(size == 0) return;
+        auto offset = pos & mask;
+        auto first = std::min<std::uint64_t>(size, ctl->capacity - offset);
+        std::memcpy(data + offset, src, first);
+        std::memcpy(data, src + first, size - first);
+    }
+
+    void zero(std::uint64_t pos, std::uint64_t size) {
+        auto offset = pos & mask;
+        auto first = std::min<std::uint64_t>(size, ctl->capacity - offset);
+        std::memset(data + offset, 0, first);
+        std::memset(data, 0, size - first);
+    }
+
+    // producer side, once the space at pos is free
+    void claim(std::uint64_t pos, size_t size, std::uint32_t tag) {
+        auto header = header_at(pos);
+        header->tag = tag;
+        header->owner = cached_pid();
+        header->length.store(static_cast<std::uint32_t>(size) | claimed, std::memory_order_release);
+    }
+
+    // Consumer side: true if the record at pos has been claimed by a process that no
+    // longer exists. Checked at most every stall_check() while the consumer is stuck there.
+    bool abandoned(std::uint64_t pos, const record_header* header, std::uint32_t length) {
+        if(not (length & claimed)) return false;
+        auto now = std::chrono::steady_clock::now();
+        if(pos != stalled_pos) {
+            stalled_pos = pos;
+            stalled_since = now;
+            return false;
+        }
+        if(now - stalled_since < stall_check()) return false;
+        stalled_since = now;
+        return header->owner > 0 && ::kill(header->owner, 0) != 0 && errno == ESRCH;
+    }
+
+public:
+    // bytes of memory needed for a ring of capacity bytes (a power of two)
+    static size_t memory_size(size_t capacity) {
+        return sizeof(control) + capacity;
+    }
+
+    static size_t round_capacity(size_t capacity) {
+        size_t res = 4096;
+        while(res < capacity) res <<= 1;
+        return res;
+    }
+
+    // Waits up to timeout for memory (memory_size bytes, initialised by someone else) to
+    // hold a ring of this layout_version that fills it exactly.
+    static bool wait_ready(const void* memory, size_t memory_size, std::chrono::milliseconds timeout) {
+        if(memory_size < sizeof(control)) return false;
+        auto ctl = static_cast<const control*>(memory);
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while(ctl->ready.load(std::memory_order_acquire) != ready_magic) {
+            if(std::chrono::steady_clock::now() >= deadline) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        auto capacity = ctl->capacity;
+        return ctl->version == layout_version && capacity >= 4096 && (capacity & (capacity - 1)) == 0
+            && byte_ring::memory_size(static_cast<size_t>(capacity)) == memory_size;
+    }
+
+    // Memory must be zero-filled if initialise is set; otherwise it must have passed
+    // wait_ready() and capacity is ignored.
+    byte_ring(void* memory, size_t capacity, bool initialise):
+        ctl(static_cast<control*>(memory)),
+        data(static_cast<char*>(memory) + sizeof(control)) {
+        if(initialise) {
+            ctl->capacity = capacity;
+            ctl->version = layout_version;
+            ctl->ready.store(ready_magic, std::memory_order_release);
+        }
+        mask = ctl->capacity - 1;
+    }
+
+    byte_ring(const byte_ring&) = delete;
+
+    std::uint64_t capacity() const { return ctl->capacity; }
+    std::uint64_t dropped() const { return ctl->dropped.load(std::memory_order_relaxed); }
+
+    // largest record that fits at all
+    size_t max_record() const { return static_cast<size_t>(ctl->capacity / 2); }
+
+    // copies the record in and commits it; false (and counted as dropped) if the ring is full
+    bool try_write(const char* src, size_t size, std::uint32_t tag = 0) {
+        return try_write(nullptr, 0, src, size, tag);
+    }
+
+    // as above, for a record made of head followed by src
+    bool try_write(const char* head, size_t head_size, const char* src, size_t src_size, std::uint32_t tag = 0) {
+        auto size = head_size + src_size;
+        auto total = aligned(sizeof(record_header) + size);
+        if(size >= claimed || total > max_record()) {
+            ctl->dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        auto pos = ctl->reserved.load(std::memory_order_relaxed);
+        do {
+            // pos may be stale and already behind released, so no subtraction here
+            if(pos + total > ctl->released.load(std::memory_order_acquire) + ctl->capacity) {
+                ctl->dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        } while(not ctl->reserved.compare_exchange_weak(pos, pos + total, std::memory_order_relaxed));
+
+        claim(pos, size, tag);
+        copy_in(pos + sizeof(record_header), head, head_size);
+        copy_in(pos + sizeof(record_header) + head_size, src, src_size);
+        header_at(pos)->length.store(static_cast<std::uint32_t>(size) | committed, std::memory_order_release);
+        return true;
+    }
+
+    // Reserves with a single fetch_add and waits for the consumer if the ring is full.
+    // Records larger than max_record() are dropped.
+    bool write(const char* src, size_t size, std::uint32_t tag = 0) {
+        auto total = aligned(sizeof(record_header) + size);
+        if(size >= claimed || total > max_record()) {
+            ctl->dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        auto pos = ctl->reserved.fetch_add(total, std::memory_order_relaxed);
+        while(pos + total > ctl->released.load(std::memory_order_acquire) + ctl->capacity) std::this_thread::yield();
+
+        claim(pos, size, tag);
+        copy_in(pos + sizeof(record_header), src, size);
+        header_at(pos)->length.store(static_cast<std::uint32_t>(size) | committed, std::memory_order_release);
+        return true;
+    }
+
+    std::uint64_t reserved() const { return ctl->reserved.load(std::memory_order_acquire); }
+    std::uint64_t released() const { return ctl->released.load(std::memory_order_acquire); }
+
+    // Single consumer. Calls on_record(tag, data, size) for each committed record in order,
+    // then on_batch() while the records are still intact, then frees their space.
+    // Returns the number of records consumed; abandoned records are freed but not counted.
+    template<class F, class G>
+    size_t consume(F on_record, G on_batch, size_t max_records = ~size_t(0)) {
+        auto start = ctl->released.load(std::memory_order_relaxed);
+        auto pos = start;
+        size_t count = 0;
+        // beyond start + capacity a header would alias a record of this batch
+        while(count < max_records && pos != ctl->reserved.load(std::memory_order_acquire)
+              && pos + sizeof(record_header) <= start + ctl->capacity) {
+            auto header = header_at(pos);
+            auto length = header->length.load(std::memory_order_acquire);
+            if(not (length & committed)) {
+                if(not abandoned(pos, header, length)) break;
+                ctl->dropped.fetch_add(1, std::memory_order_relaxed);
+                pos += aligned(sizeof(record_header) + (length & ~claimed));
+                continue;
+            }
+            length &= ~committed;
+
+            auto offset = (pos + sizeof(record_header)) & mask;
+            if(offset + length <= ctl->capacity) {
+                on_record(header->tag, data + offset, static_cast<size_t>(length));
+            } else {
+                auto first = static_cast<size_t>(ctl->capacity - offset);
+                scratch.assign(data + offset, first);
+                scratch.append(data, length - first);
+                on_record(header->tag, scratch.data(), scratch.size());
+            }
+            pos += aligned(sizeof(record_header) + length);
+            ++count;
+        }
+        if(pos == start) return 0;
+
+        if(count != 0) on_batch();
+        // headers must read as uncommitted when the space comes round again
+        zero(start, pos - start);
+        ctl->released.store(pos, std::memory_order_release);
+        return count;
+    }
+
+    template<class F>
+    size_t consume(F on_record) {
+        return consume(on_record, []{});
+    }
+};
+
+} /* namespace streamlogger */
+
+#endif // RING_H
@@ -0,0 +1,322 @@
+#ifndef ROLLING_SINK_H
+#define ROLLING_SINK_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#ifdef STREAMLOGGER_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#include "lib/date/date.h"
+
+#include "common.h"
+#include "sink.h"
+
+namespace streamlogger {
+
+// Closes, renames, compresses and expires rotated segments on its own thread.
+class segment_archiver {
+public:
+    struct job {
+        int fd;                  // the finished segment, still open
+        std::string active_path; // where the next segment is currently being written
+        std::string archive_path;
+    };
+
+private:
+    std::string filename;
+    bool compress;
+    size_t max_files;
+    size_t max_total_size;
+
+    // archived segments, oldest first
+    std::deque<std::pair<std::string, size_t>> archives;
+    // highest n of the <filename>.active-<n> segments found on disk
+    size_t active_sequence = 0;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<job> jobs;
+    bool done = false;
+    std::thread worker;
+
+    static size_t file_size(const std::string& path) {
+        struct stat st;
+        if(::stat(path.c_str(), &st) != 0) return 0;
+        return static_cast<size_t>(st.st_size);
+    }
+
+    static std::pair<std::string, std::string> split_path(const std::string& path) {
+        auto slash = path.find_last_of('/');
+        if(slash == std::string::npos) return { ".", path };
+        return { path.substr(0, slash + 1), path.substr(slash + 1) };
+    }
+
+    // segments left over from earlier runs: <filename>.<digit>..., and the active
+    // segments of a run that ended before they were renamed
+    void scan_existing() {
+        auto dir_base = split_path(filename);
+        auto dir = ::opendir(dir_base.first.c_str());
+        if(not dir) return;
+
+        // (sort key, path, size); names are <prefix><YYYYmmdd-HHMMSS>[-NNN][.gz]
+        std::vector<std::tuple<std::string, std::string, size_t>> found;
+        auto prefix = dir_base.second + ".";
+        auto active = prefix + "active-";
+        while(auto entry = ::readdir(dir)) {
+            std::string name = entry->d_name;
+            if(name.size() > active.size() && name.compare(0, active.size(), active) == 0) {
+                auto n = std::strtoul(name.c_str() + active.size(), nullptr, 10);
+                active_sequence = std::max<size_t>(active_sequence, n);
+                continue;
+            }
+            if(name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0
+               && '0' <= name[prefix.size()] && name[prefix.size()] <= '9') {
+                auto path = dir_base.first == "." ? name : dir_base.first + name;
+                auto key = name.substr(prefix.size());
+                if(key.size() > 3 && key.compare(key.size() - 3, 3, ".gz") == 0) key.resize(key.size() - 3);
+                if(key.find('-', 9) == std::string::npos) key += "-000";
+                found.emplace_back(key, path, file_size(path));
+            }
+        }
+        ::closedir(dir);
+
+        std::sort(found.begin(), found.end());
+        for(auto&& f : found) archives.emplace_back(std::get<1>(f), std::get<2>(f));
+    }
+
+#ifdef STREAMLOGGER_WITH_ZLIB
+    static bool gzip_file(const std::string& from, const std::string& to) {
+        int in = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+        if(in < 0) return false;
+        gzFile out = ::gzopen(to.c_str(), "wb6");
+        if(not out) {
+            ::close(in);
+            return false;
+        }
+
+        bool ok = true;
+        char chunk[1 << 16];
+        for(;;) {
+            auto got = ::read(in, chunk, sizeof(chunk));
+            if(got < 0 && errno == EINTR) continue;
+            if(got <= 0) {
+                ok = (got == 0);
+                break;
+            }
+            if(::gzwrite(out, chunk, static_cast<unsigned>(got)) != got) {
+                ok = false;
+                break;
+            }
+        }
+        ::close(in);
+        if(::gzclose(out) != Z_OK) ok = false;
+        return ok;
+    }
+#endif
+
+    void enforce_retention() {
+        size_t total = 0;
+        for(auto&& a : archives) total += a.second;
+
+        while(not archives.empty()
+              && ((max_files != 0 && archives.size() > max_files)
+               || (max_total_size != 0 && total > max_total_size))) {
+            ::unlink(archives.front().first.c_str());
+            total -= archives.front().second;
+            archives.pop_front();
+        }
+    }
+
+    static bool exists(const std::string& path) {
+        struct stat st;
+        return ::stat(path.c_str(), &st) == 0;
+    }
+
+    // path, or path-001, path-002... if an earlier segment (or its .gz) already took it
+    static std::string unique_path(const std::string& path) {
+        auto res = path;
+        for(unsigned n = 1; exists(res) || exists(res + ".gz"); ++n) {
+            char suffix[16];
+            std::snprintf(suffix, sizeof(suffix), "-%03u", n);
+            res = path + suffix;
+        }
+        return res;
+    }
+
+    void process(const job& j) {
+        ::close(j.fd);
+        auto archived = unique_path(j.archive_path);
+        ::rename(filename.c_str(), archived.c_str());
+        ::rename(j.active_path.c_str(), filename.c_str());
+
+#ifdef STREAMLOGGER_WITH_ZLIB
+        if(compress) {
+            auto gz = archived + ".gz";
+            if(gzip_file(archived, gz)) {
+                ::unlink(archived.c_str());
+                archived = gz;
+            } else ::unlink(gz.c_str());
+        }
+#endif
+        archives.emplace_back(archived, file_size(archived));
+        enforce_retention();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;) {
+            wake.wait(lock, [this]{ return done || not jobs.empty(); });
+            if(jobs.empty()) return;
+
+            auto j = std::move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            process(j);
+            lock.lock();
+        }
+    }
+
+public:
+    segment_archiver(const std::string& filename, bool compress, size_t max_files, size_t max_total_size):
+        filename(filename), compress(compress), max_files(max_files), max_total_size(max_total_size) {
+        scan_existing();
+        worker = std::thread([this]{ run(); });
+    }
+
+    segment_archiver(const segment_archiver&) = delete;
+
+    size_t last_active_sequence() const { return active_sequence; }
+
+    // finishes all queued jobs
+    ~segment_archiver() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    void push(job j) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(j));
+        }
+        wake.notify_one();
+    }
+};
+
+// A file_sink that switches to a fresh file by size and/or time. The logging thread only
+// opens the next segment; closing, renaming, compression and retention happen on a
+// segment_archiver thread. Until the archiver catches up the new segment is named
+// <filename>.active-<n>; n continues after any such file an earlier run left behind,
+// so that one is never overwritten.
+class rolling_file_sink: public file_sink {
+public:
+    struct options {
+        size_t max_size = 0;               // rotate before the active file exceeds this (0: no limit)
+        std::chrono::seconds interval{ 0 }; // rotate at multiples of this since the epoch, local time (0: never)
+        size_t max_files = 0;              // rotated segments to keep (0: all)
+        size_t max_total_size = 0;         // total size of rotated segments to keep (0: no limit)
+        bool compress = false;             // gzip rotated segments, needs STREAMLOGGER_WITH_ZLIB and -lz
+                                           // (the configurator rejects it otherwise)
+    };
+
+private:
+    std::string filename;
+    options opts;
+    size_t segment_size;
+    std::chrono::system_clock::time_point next_rotation;
+    size_t sequence = 0;
+    segment_archiver archiver;
+
+    std::chrono::system_clock::time_point rotation_after(std::chrono::system_clock::time_point now) const {
+        using namespace std::chrono;
+        if(opts.interval.count() == 0) return system_clock::time_point::max();
+        auto local = duration_cast<seconds>((now + util::local_tz_offset()).time_since_epoch());
+        auto next = (local / opts.interval + 1) * opts.interval;
+        return system_clock::time_point(next - util::local_tz_offset());
+    }
+
+    // made unique by the archiver if several segments end within a second
+    std::string archive_name(std::chrono::system_clock::time_point now) const {
+        return filename + "." + date::format("%Y%m%d-%H%M%S", date::floor<std::chrono::seconds>(now + util::local_tz_offset()));
+    }
+
+    // sink_mutex must be held
+    void rotate(std::chrono::system_clock::time_point now) {
+        next_rotation = rotation_after(now);
+
+        auto active = filename + ".active-" + std::to_string(++sequence);
+        int next_fd = open_file(active.c_str(), mode::APPEND);
+        if(next_fd < 0) {
+            ++stats_.errors;
+            return;
+        }
+
+        flush_pending();
+        archiver.push({ fd, active, archive_name(now) });
+        fd = next_fd;
+        segment_size = 0;
+    }
+
+    void output(const message_info& mi, const char* data, size_t size) override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(fd < 0) return;
+
+        auto now = std::chrono::system_clock::now();
+        bool too_big = opts.max_size != 0 && segment_size != 0 && segment_size + size > opts.max_size;
+        if(too_big || now >= next_rotation) rotate(now);
+
+        append_record(mi, data, size);
+        segment_size += size;
+    }
+
+    static size_t current_size(int fd) {
+        struct stat st;
+        if(fd < 0 || ::fstat(fd, &st) != 0) return 0;
+        return static_cast<size_t>(st.st_size);
+    }
+
+public:
+    rolling_file_sink(const std::string& filename, options opts, flush_policy policy = {}):
+        file_sink(filename, mode::APPEND, policy),
+        filename(filename),
+        opts(opts),
+        segment_size(current_size(fd)),
+        next_rotation(rotation_after(std::chrono::system_clock::now())),
+        archiver(filename, opts.compress, opts.max_files, opts.max_total_size) {
+        sequence = archiver.last_active_sequence();
+    }
+
+    virtual ~rolling_file_sink() {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        flush_pending();
+    }
+
+    // the options only apply to the first request for a given file
+    static std::shared_ptr<sink> instance(const std::string& filename, options opts, flush_policy policy = {}) {
+        static std::unordered_map<std::string, std::shared_ptr<sink>> registry;
+        auto it = registry.find(filename);
+        if(it == registry.end()) {
+            return registry[filename] = std::make_shared<rolling_file_sink>(filename, opts, policy);
+        } else return it->second;
+    }
+};
+
+} /* namespace streamlogger */
+
+#endif // ROLLING_SINK_H
@@ -0,0 +1,210 @@
+#ifndef SHM_SINK_H
+#define SHM_SINK_H
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "ring.h"
+#include "sink.h"
+#include "timestamp.h"
+
+namespace streamlogger {
+
+// Writes rendered records into a byte_ring in shared memory, so that several processes
+// can log through one collector. Writing never blocks and never enters the kernel; a full
+// ring drops the record and counts it.
+//
+// With an empty name the ring is an anonymous memfd: create the sink before forking and
+// every child writes into the same ring. With a name ("/app-log") it is a POSIX shared
+// memory object that unrelated processes can open.
+//
+// collect_into() starts a collector thread in the calling process, which moves records
+// from the ring into ordinary sinks in the order their space was reserved. Each record
+// carries its level, its time and its category (up to max_category bytes); the caller
+// and location are not carried across.
+class shm_ring_sink: public sink {
+    std::string name;
+    bool created = false;
+    void* memory = nullptr;
+    size_t memory_size = 0;
+    std::unique_ptr<byte_ring> ring;
+
+    // the collector, owned by the process that started it
+    pid_t collector_pid = 0;
+    std::thread* collector = nullptr;
+    std::vector<std::shared_ptr<sink>> targets;
+    std::atomic<bool> stop{ false };
+    // collector side: the last category seen and its interned copy
+    std::string last_category;
+    const char* last_interned = "";
+
+    // record prefix: u64 ns since the epoch, u8 category size, category
+    static constexpr size_t max_category = 255;
+    static constexpr size_t prefix_size = 9;
+
+    void handle_start(const message_info&) override {}
+    void handle_end(const message_info&) override {}
+
+    void output(const message_info& mi, const char* data, size_t size) override {
+        if(not ring) return;
+        // the ticks of a TSC clock mean nothing in another process
+        char prefix[prefix_size + max_category];
+        auto ns = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            clock::to_time_point(mi.time_point).time_since_epoch()).count());
+        std::memcpy(prefix, &ns, sizeof(ns));
+        auto category_size = std::min(std::strlen(mi.category), size_t(max_category));
+        prefix[8] = static_cast<char>(category_size);
+        std::memcpy(prefix + prefix_size, mi.category, category_size);
+        ring->try_write(prefix, prefix_size + category_size, data, size, static_cast<std::uint32_t>(mi.level));
+    }
+
+    // collector side; a stable copy of the category
+    const char* intern_category(essentials::string_view category) {
+        if(category != essentials::string_view(last_category)) {
+            last_category.assign(category.data(), category.size());
+            last_interned = util::intern(last_category);
+        }
+        return last_interned;
+    }
+
+    // opens (or creates) the shared memory; returns the fd and whether it is new
+    static int open_memory(const std::string& name, bool& created) {
+        if(name.empty()) {
+            created = true;
+            return ::memfd_create("streamlogger", MFD_CLOEXEC);
+        }
+        int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        created = fd >= 0;
+        if(fd < 0 && errno == EEXIST) fd = ::shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0600);
+        return fd;
+    }
+
+    // size of an object created by someone else, once it has been sized
+    static size_t wait_for_size(int fd) {
+        struct stat st;
+        for(int i = 0; i < 1000; ++i) {
+            if(::fstat(fd, &st) != 0) return 0;
+            if(st.st_size > 0) return static_cast<size_t>(st.st_size);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return 0;
+    }
+
+    size_t drain() {
+        message_info mi;
+        return ring->consume(
+            [&](std::uint32_t tag, const char* data, size_t size) {
+                if(size < prefix_size) return;
+                std::uint64_t ns;
+                std::memcpy(&ns, data, sizeof(ns));
+                auto category_size = static_cast<unsigned char>(data[8]);
+                if(size < prefix_size + category_size) return;
+                mi.level = static_cast<level>(tag);
+                mi.time_point.ticks = ns;
+                mi.time_point.source = clock_source::REALTIME;
+                mi.category = intern_category(essentials::string_view(data + prefix_size, category_size));
+                data += prefix_size + category_size;
+                size -= prefix_size + category_size;
+                for(auto&& t : targets) t->write(mi, essentials::string_view(data, size));
+            }
+        );
+    }
+
+    void collect() {
+        auto idle = std::chrono::microseconds(100);
+        while(not stop.load(std::memory_order_acquire)) {
+            if(drain() != 0) {
+                idle = std::chrono::microseconds(100);
+                continue;
+            }
+            for(auto&& t : targets) t->flush();
+            std::this_thread::sleep_for(idle);
+            idle = std::min<std::chrono::microseconds>(idle * 2, std::chrono::milliseconds(10));
+        }
+        while(drain() != 0) {}
+        for(auto&& t : targets) t->flush();
+    }
+
+    // maps the ring, creating it if need be; false if an existing object is not a usable ring
+    bool open(size_t capacity) {
+        int fd = open_memory(name, created);
+        if(fd < 0) return false;
+
+        memory_size = created ? byte_ring::memory_size(capacity) : wait_for_size(fd);
+        if(memory_size == 0 || (created && ::ftruncate(fd, static_cast<off_t>(memory_size)) != 0)) {
+            ::close(fd);
+            return false;
+        }
+        memory = ::mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if(memory == MAP_FAILED) {
+            memory = nullptr;
+            return false;
+        }
+        // an object left behind by a creator that died, or by another version, is not used
+        if(not created && not byte_ring::wait_ready(memory, memory_size, std::chrono::seconds(1))) {
+            ::munmap(memory, memory_size);
+            memory = nullptr;
+            return false;
+        }
+        ring.reset(new byte_ring(memory, capacity, created));
+        return true;
+    }
+
+public:
+    // capacity is rounded up to a power of two; ignored when opening an existing ring
+    explicit shm_ring_sink(const std::string& name = "", size_t capacity = 4 << 20): sink(), name(name) {
+        capacity = byte_ring::round_capacity(capacity);
+        // replace a stale object once
+        if(not open(capacity) && not created && not name.empty() && ::shm_unlink(name.c_str()) == 0) open(capacity);
+    }
+
+    virtual ~shm_ring_sink() {
+        // a forked child has a copy of the collector's std::thread but not the thread
+        if(collector && collector_pid == ::getpid()) {
+            stop.store(true, std::memory_order_release);
+            collector->join();
+            delete collector;
+            if(created && not name.empty()) ::shm_unlink(name.c_str());
+        }
+        ring.reset();
+        if(memory) ::munmap(memory, memory_size);
+    }
+
+    bool is_open() const { return ring != nullptr; }
+
+    // records dropped because the ring was full, by any process
+    std::uint64_t dropped() const { return ring ? ring->dropped() : 0; }
+
+    // starts moving records into targets on a thread of this process; once per ring
+    void collect_into(std::vector<std::shared_ptr<sink>> sinks) {
+        if(not ring || collector) return;
+        targets = std::move(sinks);
+        collector_pid = ::getpid();
+        collector = new std::thread([this]{ collect(); });
+    }
+
+    // the capacity only applies to the first request for a given name
+    static std::shared_ptr<shm_ring_sink> instance(const std::string& name, size_t capacity = 4 << 20) {
+        static std::unordered_map<std::string, std::shared_ptr<shm_ring_sink>> registry;
+        auto it = registry.find(name);
+        if(it == registry.end()) {
+            return registry[name] = std::make_shared<shm_ring_sink>(name, capacity);
+        } else return it->second;
+    }
+};
+
+} /* namespace streamlogger */
+
+#endif // SHM_SINK_H
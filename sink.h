@@ -1,9 +1,21 @@
 #ifndef SINK_H
 #define SINK_H
 
+#include <algorithm>
+#include <condition_variable>
 #include <mutex>
 #include <fstream>
+#include <vector>
 #include <bits/unordered_map.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 #include "common.h"
 
 namespace streamlogger {
@@ -18,98 +30,511 @@ protected:
     virtual void handle_end(const message_info& mi) = 0;
 
     sink(std::ostream *stream, bool owns_stream): stream(stream), owns_stream(owns_stream), sink_mutex{} {}
+    // for sinks that override output() and flush() and do not write to a stream
+    sink(): sink(nullptr, false) {}
     virtual ~sink() {
         if(owns_stream) delete stream;
     }
 
-    template<
-        class T,
-        class = std::enable_if_t<
-            not std::is_same<std::decay_t<T>, message_start>::value
-         && not std::is_same<std::decay_t<T>, message_end>::value
-        >
-    >
-    void output(T&& value) {
-        (*stream) << std::forward<T>(value);
+    // the whole rendered record arrives at once, so the lock only covers a single append
+    virtual void output(const message_info& mi, const char* data, size_t size) {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        handle_start(mi);
+        stream->write(data, static_cast<std::streamsize>(size));
+        handle_end(mi);
     }
 
-    void output(const message_start& m) {
-        sink_mutex.lock();
-        handle_start(*m.info);
+public:
+    sink(const sink&) = delete;
+
+    void write(const message_info& mi, essentials::string_view record) {
+        output(mi, record.data(), record.size());
     }
 
-    void output(const message_end& m) {
-        handle_end(*m.info);
-        sink_mutex.unlock();
+    virtual void flush() {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(stream) stream->flush();
     }
 
+};
+
+// when a buffering sink hands its data to the kernel
+struct flush_policy {
+    size_t buffer_size = 64 * 1024;                 // flush once this much is buffered
+    std::chrono::milliseconds interval{ 1000 };     // flush data buffered for this long (0: never)
+    level immediate = level::ERROR;                 // records at or above this level are flushed at once
+};
+
+struct flush_stats {
+    size_t writes = 0;           // write(2) calls
+    size_t bytes = 0;
+    size_t size_flushes = 0;
+    size_t interval_flushes = 0;
+    size_t level_flushes = 0;
+    size_t explicit_flushes = 0;
+    size_t errors = 0;
+};
+
+class flushable {
 public:
-    sink() = delete;
-    sink(const sink&) = delete;
+    virtual ~flushable() = default;
+    // called periodically from the flusher thread
+    virtual void flush_if_due(std::chrono::steady_clock::time_point now) = 0;
+};
+
+// background thread enforcing flush_policy::interval for sinks that see no traffic
+class periodic_flusher {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<flushable*> targets;
+    std::chrono::milliseconds period{ 1000 };
+    std::unique_ptr<std::thread> worker;
 
-    template<class T>
-    sink& operator<<(T&& value) {
-        output(std::forward<T>(value));
-        return *this;
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;) {
+            wake.wait_for(lock, period);
+            auto now = std::chrono::steady_clock::now();
+            for(auto&& t : targets) t->flush_if_due(now);
+        }
     }
 
+    periodic_flusher() = default;
 
+public:
+    // never destroyed: sinks may unregister during static destruction
+    static periodic_flusher& instance() {
+        static periodic_flusher* result = new periodic_flusher();
+        return *result;
+    }
+
+    void add(flushable* target, std::chrono::milliseconds interval) {
+        std::lock_guard<std::mutex> lock(mutex);
+        targets.push_back(target);
+        if(interval < period) period = std::max(interval, std::chrono::milliseconds(1));
+        if(not worker) {
+            worker.reset(new std::thread([this]{ run(); }));
+            worker->detach();
+        }
+        wake.notify_one();
+    }
+
+    void remove(flushable* target) {
+        std::lock_guard<std::mutex> lock(mutex);
+        targets.erase(std::remove(targets.begin(), targets.end(), target), targets.end());
+    }
 };
 
-class cout_sink: public sink {
+// Buffers records in user space and write(2)s them according to a flush_policy.
+class file_sink: public sink, public flushable {
+public:
+    enum class mode{ APPEND, TRUNCATE };
+
+protected:
+    int fd;
+    flush_policy policy;
+    flush_stats stats_;
+    std::string pending;
+    std::chrono::steady_clock::time_point pending_since;
+
     void handle_start(const message_info&) override {}
-    void handle_end(const message_info&) override {}
+    void handle_end(const message_info& mi) override {}
+
+    static int open_file(const char* name, mode m) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+        if(m == mode::APPEND) flags |= O_APPEND;
+        if(m == mode::TRUNCATE) flags |= O_TRUNC;
+        return ::open(name, flags, 0644);
+    }
+
+    // sink_mutex must be held
+    virtual void write_fully(const char* data, size_t size) {
+        while(size > 0) {
+            auto written = ::write(fd, data, size);
+            if(written < 0) {
+                if(errno == EINTR) continue;
+                ++stats_.errors;
+                return;
+            }
+            ++stats_.writes;
+            stats_.bytes += static_cast<size_t>(written);
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+    }
+
+    // sink_mutex must be held
+    virtual void flush_pending() {
+        if(pending.empty()) return;
+        write_fully(pending.data(), pending.size());
+        pending.clear();
+    }
+
+    // sink_mutex must be held
+    void append_record(const message_info& mi, const char* data, size_t size) {
+        if(pending.size() + size > policy.buffer_size) {
+            ++stats_.size_flushes;
+            flush_pending();
+        }
+        if(pending.empty()) pending_since = std::chrono::steady_clock::now();
+
+        if(size >= policy.buffer_size) write_fully(data, size);
+        else pending.append(data, size);
+
+        if(mi.level >= policy.immediate) {
+            ++stats_.level_flushes;
+            flush_pending();
+        } else if(policy.interval.count() > 0 && not pending.empty()
+               && std::chrono::steady_clock::now() - pending_since >= policy.interval) {
+            ++stats_.interval_flushes;
+            flush_pending();
+        }
+    }
+
+    void output(const message_info& mi, const char* data, size_t size) override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(fd < 0) return;
+        append_record(mi, data, size);
+    }
 
 public:
-    cout_sink(): sink(&std::cout, false) {}
-    virtual ~cout_sink() = default;
+    file_sink(const std::string& filename, mode m = mode::APPEND, flush_policy policy = {}):
+        file_sink(filename.c_str(), m, policy) {}
+    file_sink(const char* filename, mode m = mode::APPEND, flush_policy policy = {}):
+        file_sink(open_file(filename, m), policy) {
+        pending.reserve(policy.buffer_size);
+    }
+    // takes ownership of an open descriptor
+    file_sink(int fd, flush_policy policy):
+        sink(), fd(fd), policy(policy) {
+        if(fd >= 0 && policy.interval.count() > 0) periodic_flusher::instance().add(this, policy.interval);
+    }
 
-    static std::shared_ptr<sink> instance() {
-        static auto result = std::make_shared<cout_sink>();
-        return result;
+    virtual ~file_sink() {
+        if(policy.interval.count() > 0) periodic_flusher::instance().remove(this);
+        flush_pending();
+        if(fd >= 0) ::close(fd);
+    }
+
+    void flush() override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(pending.empty()) return;
+        ++stats_.explicit_flushes;
+        flush_pending();
+    }
+
+    void flush_if_due(std::chrono::steady_clock::time_point now) override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(pending.empty() || now - pending_since < policy.interval) return;
+        ++stats_.interval_flushes;
+        flush_pending();
+    }
+
+    flush_stats stats() {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        return stats_;
+    }
+
+    // the policy only applies to the first request for a given file
+    static std::shared_ptr<sink> instance(const std::string& filename, flush_policy policy = {}) {
+        static std::unordered_map<std::string, std::shared_ptr<sink>> registry;
+        auto it = registry.find(filename);
+        if(it == registry.end()) {
+            return registry[filename] = std::make_shared<file_sink>(filename, mode::APPEND, policy);
+        } else return it->second;
     }
 };
 
-class cerr_sink: public sink {
+// Writes to a standard descriptor with write(2)/writev(2), bypassing iostreams. LINE
+// buffering writes every record as it arrives; BLOCK buffering collects records per
+// flush_policy. AUTO picks LINE for terminals and BLOCK for pipes and files.
+class console_sink: public sink, public flushable {
+public:
+    enum class buffering { AUTO, LINE, BLOCK };
+
+private:
+    int fd;
+    bool line;
+    flush_policy policy;
+    flush_stats stats_;
+    std::string pending;
+    std::chrono::steady_clock::time_point pending_since;
+
     void handle_start(const message_info&) override {}
     void handle_end(const message_info&) override {}
 
+    // sink_mutex must be held; writes pending followed by data, then clears pending
+    void write_out(const char* data, size_t size) {
+        iovec iov[2] = {
+            { &pending[0], pending.size() },
+            { const_cast<char*>(data), size }
+        };
+        iovec* first = pending.empty() ? iov + 1 : iov;
+        int count = static_cast<int>(iov + 2 - first);
+        if(iov[1].iov_len == 0) --count;
+
+        while(count > 0) {
+            auto written = ::writev(fd, first, count);
+            if(written < 0) {
+                if(errno == EINTR) continue;
+                ++stats_.errors;
+                break;
+            }
+            ++stats_.writes;
+            stats_.bytes += static_cast<size_t>(written);
+            auto left = static_cast<size_t>(written);
+            while(count > 0 && left >= first->iov_len) {
+                left -= first->iov_len;
+                ++first;
+                --count;
+            }
+            if(count > 0) {
+                first->iov_base = static_cast<char*>(first->iov_base) + left;
+                first->iov_len -= left;
+            }
+        }
+        pending.clear();
+    }
+
+    void output(const message_info& mi, const char* data, size_t size) override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(line) {
+            write_out(data, size);
+            return;
+        }
+
+        if(mi.level >= policy.immediate) {
+            ++stats_.level_flushes;
+            write_out(data, size);
+        } else if(pending.size() + size > policy.buffer_size) {
+            ++stats_.size_flushes;
+            write_out(data, size);
+        } else {
+            if(pending.empty()) pending_since = std::chrono::steady_clock::now();
+            pending.append(data, size);
+            if(policy.interval.count() > 0 && std::chrono::steady_clock::now() - pending_since >= policy.interval) {
+                ++stats_.interval_flushes;
+                write_out(nullptr, 0);
+            }
+        }
+    }
+
 public:
-    cerr_sink(): sink(&std::cerr, false) {}
-    virtual ~cerr_sink() = default;
+    // fd is not closed by the sink
+    console_sink(int fd, buffering mode = buffering::AUTO, flush_policy policy = {}):
+        sink(),
+        fd(fd),
+        line(mode == buffering::LINE || (mode == buffering::AUTO && ::isatty(fd))),
+        policy(policy) {
+        if(line) return;
+        pending.reserve(policy.buffer_size);
+        if(policy.interval.count() > 0) periodic_flusher::instance().add(this, policy.interval);
+    }
+
+    virtual ~console_sink() {
+        if(not line && policy.interval.count() > 0) periodic_flusher::instance().remove(this);
+        if(not pending.empty()) write_out(nullptr, 0);
+    }
+
+    bool line_buffered() const { return line; }
 
-    static std::shared_ptr<sink> instance() {
-        static auto result = std::make_shared<cerr_sink>();
+    void flush() override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(pending.empty()) return;
+        ++stats_.explicit_flushes;
+        write_out(nullptr, 0);
+    }
+
+    void flush_if_due(std::chrono::steady_clock::time_point now) override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(pending.empty() || now - pending_since < policy.interval) return;
+        ++stats_.interval_flushes;
+        write_out(nullptr, 0);
+    }
+
+    flush_stats stats() {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        return stats_;
+    }
+};
+
+class cout_sink: public console_sink {
+public:
+    cout_sink(buffering mode = buffering::AUTO, flush_policy policy = {}): console_sink(STDOUT_FILENO, mode, policy) {}
+    virtual ~cout_sink() = default;
+
+    // the arguments only apply to the first call
+    static std::shared_ptr<sink> instance(buffering mode = buffering::AUTO, flush_policy policy = {}) {
+        static auto result = std::make_shared<cout_sink>(mode, policy);
         return result;
     }
 };
 
-class file_sink: public sink {
+class cerr_sink: public console_sink {
 public:
-    enum class mode{ APPEND, TRUNCATE };
+    cerr_sink(buffering mode = buffering::AUTO, flush_policy policy = {}): console_sink(STDERR_FILENO, mode, policy) {}
+    virtual ~cerr_sink() = default;
+
+    // the arguments only apply to the first call
+    static std::shared_ptr<sink> instance(buffering mode = buffering::AUTO, flush_policy policy = {}) {
+        static auto result = std::make_shared<cerr_sink>(mode, policy);
+        return result;
+    }
+};
+
+struct mmap_stats {
+    size_t bytes = 0;
+    size_t maps = 0;             // windows mapped
+    size_t errors = 0;
+};
+
+// Copies records straight into a shared mapping of the file. Space is preallocated a
+// window at a time with fallocate(2); the file is cut back to the bytes actually
+// written when the sink is destroyed. Until then (or after a crash) the file ends in
+// up to a window of zero bytes; opening such a file appends after the last nonzero byte.
+class mmap_file_sink: public sink {
+    int fd;
+    size_t window_size;
+    char* window = nullptr;
+    off_t window_start = 0;
+    size_t window_used = 0;
+    // bytes already in the file past window_start when it was opened; they become
+    // window_used once that window is mapped
+    size_t resume_used = 0;
+    // end of the data found at open; the file is never cut back below it
+    off_t opened_end = 0;
+    mmap_stats stats_;
 
-private:
     void handle_start(const message_info&) override {}
-    void handle_end(const message_info& mi) override {}
+    void handle_end(const message_info&) override {}
+
+    static size_t page_aligned(size_t size) {
+        auto page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        return std::max(page, (size + page - 1) / page * page);
+    }
+
+    static bool reserve(int fd, off_t offset, off_t length) {
+        if(::fallocate(fd, 0, offset, length) == 0) return true;
+        // filesystems without fallocate support
+        if(errno != EOPNOTSUPP && errno != ENOSYS) return false;
+        return ::ftruncate(fd, offset + length) == 0;
+    }
+
+    // offset just past the last nonzero byte before size
+    static off_t data_end(int fd, off_t size) {
+        char block[65536];
+        while(size > 0) {
+            auto chunk = std::min<off_t>(size, static_cast<off_t>(sizeof(block)));
+            auto got = ::pread(fd, block, static_cast<size_t>(chunk), size - chunk);
+            if(got < 0 && errno == EINTR) continue;
+            // unreadable: keep everything
+            if(got != static_cast<ssize_t>(chunk)) return size;
+            for(auto i = chunk; i > 0; --i) {
+                if(block[i - 1] != 0) return size - chunk + i;
+            }
+            size -= chunk;
+        }
+        return 0;
+    }
 
-    template<class Name>
-    static std::ofstream* open_file(Name&& name, mode m) {
-        std::ios::openmode mode = std::ios::out;
-        if(m == mode::APPEND) mode |= std::ios::app;
-        if(m == mode::TRUNCATE) mode |= std::ios::trunc;
-        return new std::ofstream(name, mode);
+    // sink_mutex must be held
+    void unmap() {
+        if(not window) return;
+        ::munmap(window, window_size);
+        window = nullptr;
     }
+
+    // sink_mutex must be held; maps the window starting at start
+    bool map(off_t start) {
+        unmap();
+        window_start = start;
+        window_used = 0;
+        if(not reserve(fd, start, static_cast<off_t>(window_size))) {
+            ++stats_.errors;
+            return false;
+        }
+        void* addr = ::mmap(nullptr, window_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, start);
+        if(addr == MAP_FAILED) {
+            ++stats_.errors;
+            return false;
+        }
+        window = static_cast<char*>(addr);
+        window_used = resume_used;
+        resume_used = 0;
+        ++stats_.maps;
+        return true;
+    }
+
+    // length of the data written so far
+    off_t length() const {
+        return window_start + static_cast<off_t>(window_used + resume_used);
+    }
+
+    void output(const message_info&, const char* data, size_t size) override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(fd < 0) return;
+        while(size > 0) {
+            if(not window || window_used == window_size) {
+                if(not map(window ? window_start + static_cast<off_t>(window_size) : window_start)) return;
+            }
+            auto chunk = std::min(size, window_size - window_used);
+            std::memcpy(window + window_used, data, chunk);
+            window_used += chunk;
+            stats_.bytes += chunk;
+            data += chunk;
+            size -= chunk;
+        }
+    }
+
 public:
-    file_sink(const std::string& filename, mode m = mode::APPEND):
-        sink(open_file(filename, m), true) {}
-    file_sink(const char* filename, mode m = mode::APPEND):
-        sink(open_file(filename, m), true) {}
+    // window_size is rounded up to whole pages
+    mmap_file_sink(const std::string& filename, size_t window_size = 16 << 20):
+        sink(),
+        fd(::open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)),
+        window_size(page_aligned(window_size)) {
+        if(fd < 0) return;
+        // keep appending after whatever is already there, but not after the zeros that a
+        // sink which was not destroyed leaves behind
+        struct stat st;
+        if(::fstat(fd, &st) != 0) {
+            // without the size we would overwrite the file from the start
+            ::close(fd);
+            fd = -1;
+            ++stats_.errors;
+            return;
+        }
+        opened_end = data_end(fd, st.st_size);
+        auto start = opened_end / static_cast<off_t>(this->window_size) * static_cast<off_t>(this->window_size);
+        resume_used = static_cast<size_t>(opened_end - start);
+        // if this fails, output() maps the same window again
+        map(start);
+    }
+
+    virtual ~mmap_file_sink() {
+        if(fd < 0) return;
+        auto len = std::max(length(), opened_end);
+        unmap();
+        ::ftruncate(fd, len);
+        ::close(fd);
+    }
+
+    // the data is already in the page cache; this only starts writeback
+    void flush() override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(window) ::msync(window, window_size, MS_ASYNC);
+    }
+
+    mmap_stats stats() {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        return stats_;
+    }
 
-    static std::shared_ptr<sink> instance(const std::string& filename) {
+    // the window size only applies to the first request for a given file
+    static std::shared_ptr<sink> instance(const std::string& filename, size_t window_size = 16 << 20) {
         static std::unordered_map<std::string, std::shared_ptr<sink>> registry;
         auto it = registry.find(filename);
         if(it == registry.end()) {
-            return registry[filename] = std::make_shared<file_sink>(filename);
+            return registry[filename] = std::make_shared<mmap_file_sink>(filename, window_size);
         } else return it->second;
     }
 };
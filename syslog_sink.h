@@ -0,0 +1,280 @@
+#ifndef SYSLOG_SINK_H
+#define SYSLOG_SINK_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "sink.h"
+#include "timestamp.h"
+
+namespace streamlogger {
+
+struct syslog_stats {
+    size_t sent = 0;
+    size_t dropped = 0;          // frames not accepted by the receiver, e.g. a full socket buffer
+    size_t batches = 0;          // sendmmsg(2) calls
+    size_t errors = 0;           // connection failures
+};
+
+// Sends every record as one syslog datagram to a local unix socket. Frames are collected
+// into batches and sent with a single non-blocking sendmmsg(2); what the receiver does
+// not take is counted and dropped instead of stalling the logging thread.
+class syslog_sink: public sink, public flushable {
+public:
+    enum class format { RFC5424, RFC3164 };
+
+    struct options {
+        std::string path = "/dev/log";
+        format frame = format::RFC5424;
+        int facility = 1;            // user-level messages
+        std::string app_name = "-";
+        size_t batch = 32;           // frames per sendmmsg
+        flush_policy policy;         // buffer_size is ignored
+    };
+
+private:
+    options opts;
+    int fd = -1;
+    std::string hostname;
+    std::string procid;
+    timestamp_format stamp;
+    buffer stamp_text;
+
+    // frames of the current batch, back to back
+    std::string frames;
+    std::vector<std::pair<size_t, size_t>> spans;
+    std::vector<iovec> iov;
+    std::vector<mmsghdr> headers;
+    std::chrono::steady_clock::time_point pending_since;
+    syslog_stats stats_;
+
+    void handle_start(const message_info&) override {}
+    void handle_end(const message_info&) override {}
+
+    static int severity(level lvl) {
+        switch(lvl) {
+            case level::FATAL: return 2;
+            case level::ERROR: return 3;
+            case level::WARN: return 4;
+            case level::INFO: return 6;
+            default: return 7;
+        }
+    }
+
+    static std::string local_hostname() {
+        char name[256] = {0};
+        if(::gethostname(name, sizeof(name) - 1) != 0 || name[0] == 0) return "-";
+        return name;
+    }
+
+    // RFC 5424 header fields (and the RFC 3164 HOSTNAME and TAG) are 1 to max_size
+    // printable ASCII characters without spaces; anything else becomes '_', and an empty
+    // field is the nil value "-"
+    static void append_header_field(std::string& out, const char* field, size_t max_size) {
+        size_t size = 0;
+        for(; field[size] != 0 && size < max_size; ++size) {
+            auto ch = static_cast<unsigned char>(field[size]);
+            out += ch > 32 && ch < 127 ? static_cast<char>(ch) : '_';
+        }
+        if(size == 0) out += '-';
+    }
+
+    // sink_mutex must be held
+    bool connect() {
+        if(fd >= 0) return true;
+        fd = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(fd < 0) return false;
+
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, opts.path.c_str(), sizeof(addr.sun_path) - 1);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    // sink_mutex must be held
+    void disconnect() {
+        if(fd >= 0) ::close(fd);
+        fd = -1;
+    }
+
+    // sink_mutex must be held
+    void append_header(const message_info& mi) {
+        auto pri = static_cast<unsigned>(opts.facility * 8 + severity(mi.level));
+        char digits[8];
+        auto end = digits + sizeof(digits);
+        auto begin = end;
+        *--begin = '>';
+        do {
+            *--begin = static_cast<char>('0' + pri % 10);
+            pri /= 10;
+        } while(pri != 0);
+        *--begin = '<';
+        frames.append(begin, static_cast<size_t>(end - begin));
+
+        stamp_text.clear();
+        stamp.render(stamp_text, clock::to_time_point(mi.time_point));
+
+        if(opts.frame == format::RFC5424) {
+            // <PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID MSGID - MSG
+            frames += "1 ";
+            frames.append(stamp_text.data(), stamp_text.size());
+            auto offset = util::local_tz_offset().count() / 60;
+            char zone[8];
+            std::snprintf(zone, sizeof(zone), "%c%02d:%02d", offset < 0 ? '-' : '+',
+                          static_cast<int>(std::abs(offset) / 60), static_cast<int>(std::abs(offset) % 60));
+            frames += zone;
+            frames += ' ';
+            append_header_field(frames, hostname.c_str(), 255);
+            frames += ' ';
+            append_header_field(frames, opts.app_name.c_str(), 48);
+            frames += ' ';
+            frames += procid;
+            frames += ' ';
+            append_header_field(frames, mi.category, 32);
+            frames += " - ";
+        } else {
+            // <PRI>Mmm dd hh:mm:ss HOSTNAME TAG[PID]: MSG
+            frames.append(stamp_text.data(), stamp_text.size());
+            frames += ' ';
+            append_header_field(frames, hostname.c_str(), 255);
+            frames += ' ';
+            append_header_field(frames, opts.app_name.c_str(), 32);
+            frames += '[';
+            frames += procid;
+            frames += "]: ";
+        }
+    }
+
+    // sink_mutex must be held
+    void send_batch() {
+        if(spans.empty()) return;
+
+        if(not connect()) {
+            ++stats_.errors;
+            stats_.dropped += spans.size();
+            frames.clear();
+            spans.clear();
+            return;
+        }
+
+        iov.resize(spans.size());
+        headers.resize(spans.size());
+        for(size_t i = 0; i < spans.size(); ++i) {
+            iov[i].iov_base = &frames[spans[i].first];
+            iov[i].iov_len = spans[i].second;
+            std::memset(&headers[i], 0, sizeof(mmsghdr));
+            headers[i].msg_hdr.msg_iov = &iov[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        size_t done = 0;
+        while(done < spans.size()) {
+            ++stats_.batches;
+            auto sent = ::sendmmsg(fd, headers.data() + done, static_cast<unsigned>(spans.size() - done), MSG_DONTWAIT);
+            if(sent > 0) {
+                stats_.sent += static_cast<size_t>(sent);
+                done += static_cast<size_t>(sent);
+                continue;
+            }
+            if(errno == EINTR) continue;
+            if(errno == EMSGSIZE) {
+                // a single oversized frame; the rest may still fit
+                ++stats_.dropped;
+                ++done;
+                continue;
+            }
+            // EAGAIN/ENOBUFS: the receiver is behind; anything else: reconnect next time
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+                ++stats_.errors;
+                disconnect();
+            }
+            stats_.dropped += spans.size() - done;
+            break;
+        }
+
+        frames.clear();
+        spans.clear();
+    }
+
+    void output(const message_info& mi, const char* data, size_t size) override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        // one record per datagram; the pattern's trailing newline is not part of it
+        while(size > 0 && (data[size - 1] == '\n' || data[size - 1] == '\r')) --size;
+
+        if(spans.empty()) pending_since = std::chrono::steady_clock::now();
+        auto start = frames.size();
+        append_header(mi);
+        frames.append(data, size);
+        spans.emplace_back(start, frames.size() - start);
+
+        if(spans.size() >= opts.batch || mi.level >= opts.policy.immediate) send_batch();
+        else if(opts.policy.interval.count() > 0
+                && std::chrono::steady_clock::now() - pending_since >= opts.policy.interval) send_batch();
+    }
+
+public:
+    explicit syslog_sink(options opts):
+        sink(),
+        opts(opts),
+        hostname(local_hostname()),
+        procid(std::to_string(::getpid())),
+        // RFC 5424 allows at most microseconds
+        stamp(opts.frame == format::RFC5424 ? "%FT%T" : "%b %e %H:%M:%OS", 6) {
+        if(this->opts.batch == 0) this->opts.batch = 1;
+        if(this->opts.app_name.empty()) this->opts.app_name = "-";
+        spans.reserve(this->opts.batch);
+        if(opts.policy.interval.count() > 0) periodic_flusher::instance().add(this, opts.policy.interval);
+    }
+
+    virtual ~syslog_sink() {
+        if(opts.policy.interval.count() > 0) periodic_flusher::instance().remove(this);
+        send_batch();
+        disconnect();
+    }
+
+    void flush() override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        send_batch();
+    }
+
+    void flush_if_due(std::chrono::steady_clock::time_point now) override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(spans.empty() || now - pending_since < opts.policy.interval) return;
+        send_batch();
+    }
+
+    syslog_stats stats() {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        return stats_;
+    }
+
+    // the options only apply to the first request for a given socket path
+    static std::shared_ptr<sink> instance(const options& opts) {
+        static std::unordered_map<std::string, std::shared_ptr<sink>> registry;
+        auto it = registry.find(opts.path);
+        if(it == registry.end()) {
+            return registry[opts.path] = std::make_shared<syslog_sink>(opts);
+        } else return it->second;
+    }
+};
+
+} /* namespace streamlogger */
+
+#endif // SYSLOG_SINK_H
@@ -0,0 +1,203 @@
+// Binary log sites and records written and read back, through binary_log.h directly and
+// through deferred::backend and the decoder (whose path is the first argument), including
+// truncated and corrupt input.
+
+#include <streamlogger/deferred.h>
+#include <streamlogger/sink.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+
+#include "check.h"
+
+using namespace streamlogger;
+
+namespace {
+
+binlog::site_info make_site(std::vector<binlog::arg_type> types, std::string format) {
+    binlog::site_info site;
+    site.id = 7;
+    site.lvl = level::WARN;
+    site.line = 42;
+    site.category = "net.tcp";
+    site.format = std::move(format);
+    site.file = "conn.cpp";
+    site.function = "send";
+    site.types = std::move(types);
+    site.split_format();
+    return site;
+}
+
+std::string render(const binlog::site_info& site, const std::string& args, bool* ok = nullptr) {
+    buffer out;
+    binlog::reader in(args.data(), args.size());
+    bool res = binlog::render(site, in, out);
+    if(ok) *ok = res;
+    return out.str();
+}
+
+void round_trip() {
+    using t = binlog::arg_type;
+    auto site = make_site({ t::INT, t::UINT, t::BOOL, t::CHAR, t::STRING, t::POINTER }, "{} {} {} {} [{}] {} end");
+    std::string encoded;
+    binlog::write_site(encoded, site);
+
+    binlog::reader in(encoded.data(), encoded.size());
+    auto read = binlog::read_site(in);
+    CHECK(in.ok() && in.done());
+    CHECK(read.valid);
+    CHECK(read.id == site.id && read.lvl == site.lvl && read.line == site.line);
+    CHECK(read.category == site.category && read.format == site.format);
+    CHECK(read.file == site.file && read.function == site.function);
+    CHECK(read.types == site.types);
+
+    std::string args;
+    binlog::put(args, std::int64_t(-12));
+    binlog::put(args, std::uint64_t(18446744073709551615u));
+    binlog::put(args, std::uint8_t(1));
+    binlog::put(args, 'x');
+    binlog::put_string(args, "a{}b");
+    binlog::put(args, std::uint64_t(0));
+    bool ok = false;
+    auto text = render(read, args, &ok);
+    CHECK(ok);
+    CHECK(text.find("-12 18446744073709551615 1 x [a{}b] ") == 0);
+    CHECK(text.size() > 6 && text.compare(text.size() - 4, 4, " end") == 0);
+
+    // every shorter argument block is refused without reading past its end
+    for(size_t size = 0; size < args.size(); ++size) {
+        render(read, args.substr(0, size), &ok);
+        CHECK(not ok);
+    }
+    // and so is every shorter site
+    for(size_t size = 0; size < encoded.size(); ++size) {
+        auto prefix = encoded.substr(0, size);
+        binlog::reader r(prefix.data(), prefix.size());
+        binlog::read_site(r);
+        CHECK(not r.ok());
+    }
+}
+
+// LITERALs point into the writing process: written as STRING, refused when read
+void literals() {
+    using t = binlog::arg_type;
+    auto site = make_site({ t::LITERAL }, "<{}>");
+    std::string encoded;
+    binlog::write_site(encoded, site);
+    binlog::reader in(encoded.data(), encoded.size());
+    auto read = binlog::read_site(in);
+    CHECK(in.ok() && read.valid);
+    CHECK(read.types.size() == 1 && read.types[0] == t::STRING);
+
+    static const char text[] = "literal";
+    std::string memory_args;
+    binlog::put(memory_args, static_cast<const char*>(text));
+    binlog::put(memory_args, std::uint32_t(7));
+    std::string file_args;
+    binlog::reader args_in(memory_args.data(), memory_args.size());
+    CHECK(binlog::transcode_args(site, args_in, file_args));
+    CHECK(render(read, file_args) == "<literal>");
+
+    // a LITERAL type byte in a file, an unknown type byte and an out of range id
+    for(auto corrupt : { 0, 1, 2 }) {
+        auto bad = make_site({ t::STRING }, "{}");
+        std::string bytes;
+        binlog::write_site(bytes, bad);
+        if(corrupt == 0) bytes[6] = static_cast<char>(t::LITERAL);
+        if(corrupt == 1) bytes[6] = static_cast<char>(200);
+        if(corrupt == 2) {
+            auto id = binlog::max_sites;
+            std::memcpy(&bytes[0], &id, sizeof(id));
+        }
+        binlog::reader r(bytes.data(), bytes.size());
+        CHECK(not binlog::read_site(r).valid);
+        CHECK(r.ok());
+    }
+}
+
+std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string& path, const std::string& contents) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+}
+
+// exit status of the decoder run on input, with its output in output
+int decode(const std::string& decoder, const std::string& input, const std::string& output) {
+    auto command = decoder + " -t 2 -p '%c %p %m%n' -o " + output + " " + input + " 2>/dev/null";
+    auto status = std::system(command.c_str());
+    CHECK(status != -1 && WIFEXITED(status));
+    return WEXITSTATUS(status);
+}
+
+void file_round_trip(const std::string& decoder) {
+    const std::string log = "binlog_test.slb";
+    const std::string text = "binlog_test.txt";
+    const int records = 20000;
+
+    category cat("binlog");
+    cat.add_sink(std::make_shared<cerr_sink>(), "%m%n");
+    auto& backend = deferred::backend::instance();
+    CHECK(backend.write_binary(log));
+    for(int i = 0; i < records; ++i) {
+        STREAMLOGGER_DEFER(cat, level::INFO, "record {} of {}: {}", i, records, deferred::literal("text"));
+        if(i % 1000 == 0) backend.flush();
+    }
+    backend.flush();
+    backend.shutdown();
+    CHECK(backend.dropped() == 0);
+
+    std::ostringstream expected;
+    for(int i = 0; i < records; ++i) expected << "binlog INFO record " << i << " of " << records << ": text\n";
+
+    CHECK(decode(decoder, log, text) == 0);
+    CHECK(read_file(text) == expected.str());
+
+    // a file cut short loses the records of its last chunk, and nothing else
+    auto contents = read_file(log);
+    write_file(log + ".short", contents.substr(0, contents.size() - 5));
+    CHECK(decode(decoder, log + ".short", text) == 0);
+    auto partial = read_file(text);
+    CHECK(partial.size() < expected.str().size());
+    CHECK(expected.str().compare(0, partial.size(), partial) == 0);
+
+    // a chunk header with an impossible size ends decoding with an error
+    binlog::chunk_header header{ static_cast<std::uint32_t>(binlog::chunk_type::RECORDS), 0xfffffff0u, 1, 0 };
+    write_file(log + ".corrupt", contents + std::string(reinterpret_cast<const char*>(&header), sizeof(header)));
+    CHECK(decode(decoder, log + ".corrupt", text) == 1);
+    CHECK(read_file(text) == expected.str());
+
+    // records of unknown sites are skipped
+    std::string payload;
+    binlog::put(payload, std::uint32_t(12345));
+    binlog::put(payload, std::uint32_t(0));
+    binlog::put(payload, std::uint64_t(0));
+    binlog::put(payload, std::uint32_t(0));
+    header.size = static_cast<std::uint32_t>(payload.size());
+    write_file(log + ".unknown", contents + std::string(reinterpret_cast<const char*>(&header), sizeof(header)) + payload);
+    CHECK(decode(decoder, log + ".unknown", text) == 0);
+    CHECK(read_file(text) == expected.str());
+
+    CHECK(decode(decoder, text, text + ".out") == 1); // not a binary log
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    round_trip();
+    literals();
+    if(argc > 1) file_round_trip(argv[1]);
+    return 0;
+}
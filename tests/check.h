@@ -0,0 +1,16 @@
+#ifndef TESTS_CHECK_H
+#define TESTS_CHECK_H
+
+#include <cstdio>
+#include <cstdlib>
+
+// aborts the test with the failed condition; tests are plain programs run by ctest
+#define CHECK(COND) \
+    do { \
+        if(not (COND)) { \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #COND); \
+            std::exit(1); \
+        } \
+    } while(false)
+
+#endif // TESTS_CHECK_H
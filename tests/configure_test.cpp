@@ -0,0 +1,81 @@
+// Records logged on several threads while configure() replaces the configuration over
+// and over: each one must reach the file exactly once, through the old or the new layout.
+
+#include <streamlogger/configurator.h>
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+
+using namespace streamlogger;
+
+namespace {
+
+constexpr int threads = 4;
+constexpr int records_per_thread = 20000;
+const char* log_name = "configure_test.log";
+
+// both configurations write to the same file (and so the same file_sink)
+std::string write_config(int variant) {
+    auto name = "configure_test" + std::to_string(variant) + ".ini";
+    std::ofstream out(name, std::ios::trunc);
+    auto appender = variant == 0 ? "A" : "B";
+    if(variant == 0) out << "rootCategory=ALL, A\n";
+    else out << "rootCategory=WARN\ncategory.reconf=INFO, B\n";
+    out << "appender." << appender << "=FileAppender\n"
+        << "appender." << appender << ".fileName=" << log_name << "\n"
+        << "appender." << appender << ".layout=PatternLayout\n"
+        << "appender." << appender << ".layout.ConversionPattern=" << appender << " %m%n\n";
+    return name;
+}
+
+} // namespace
+
+int main() {
+    std::remove(log_name);
+    std::string configs[] = { write_config(0), write_config(1) };
+    configure(configs[0]);
+
+    std::atomic<int> running{ threads };
+    std::vector<std::thread> loggers;
+    for(int t = 0; t < threads; ++t) {
+        loggers.emplace_back([t, &running]{
+            for(int i = 0; i < records_per_thread; ++i) {
+                // an unconfigured child resolves to its configured ancestor
+                info(i % 2 ? "reconf" : "reconf.child") << t << ' ' << i;
+            }
+            --running;
+        });
+    }
+    int reconfigurations = 0;
+    while(running.load() != 0) {
+        configure(configs[++reconfigurations % 2]);
+    }
+    for(auto&& l : loggers) l.join();
+    info("reconf").flush();
+    CHECK(reconfigurations > 1);
+
+    std::vector<std::vector<int>> seen(threads, std::vector<int>(records_per_thread, 0));
+    std::ifstream in(log_name);
+    std::string line;
+    while(std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string layout;
+        int t = -1;
+        int i = -1;
+        fields >> layout >> t >> i;
+        CHECK(layout == "A" || layout == "B");
+        CHECK(t >= 0 && t < threads && i >= 0 && i < records_per_thread);
+        ++seen[t][i];
+    }
+    for(auto&& per_thread : seen) {
+        for(auto count : per_thread) CHECK(count == 1);
+    }
+    return 0;
+}
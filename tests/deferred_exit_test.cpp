@@ -0,0 +1,61 @@
+// A child process logs through STREAMLOGGER_DEFER into a registry category and exits
+// without calling deferred::backend::shutdown(); every record must still reach the file.
+
+#include <streamlogger/configurator.h>
+#include <streamlogger/deferred.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "check.h"
+
+using namespace streamlogger;
+
+namespace {
+
+constexpr int records = 20000;
+const char* log_name = "deferred_exit_test.log";
+
+void child() {
+    {
+        std::ofstream out("deferred_exit_test.ini", std::ios::trunc);
+        out << "rootCategory=ALL, A\n"
+            << "appender.A=FileAppender\n"
+            << "appender.A.fileName=" << log_name << "\n"
+            << "appender.A.layout=PatternLayout\n"
+            << "appender.A.layout.ConversionPattern=%c %m%n\n";
+    }
+    configure("deferred_exit_test.ini");
+    deferred::backend::instance().set_buffer_size(8 << 20);
+    auto& cat = registry::registerCategory("deferred");
+    for(int i = 0; i < records; ++i) STREAMLOGGER_DEFER(cat, level::INFO, "record {}", i);
+    std::exit(0); // as if returning from main: static destructors run
+}
+
+} // namespace
+
+int main() {
+    std::remove(log_name);
+    auto pid = ::fork();
+    CHECK(pid >= 0);
+    if(pid == 0) child();
+
+    int status = 0;
+    CHECK(::waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    std::ifstream in(log_name);
+    std::string line;
+    int expected = 0;
+    while(std::getline(in, line)) {
+        CHECK(line == "deferred record " + std::to_string(expected));
+        ++expected;
+    }
+    CHECK(expected == records);
+    return 0;
+}
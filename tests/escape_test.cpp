@@ -0,0 +1,192 @@
+// The vectorised clean_run implementations against clean_run_scalar, for every length
+// around the 16, 32 and 64 byte blocks and a special byte at every position; then
+// UTF-8 validation and the JSON and text escaping built on them, with expected output.
+
+#include <streamlogger/buffer.h>
+#include <streamlogger/escape.h>
+#include <streamlogger/formatter.h>
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "check.h"
+
+using namespace streamlogger;
+
+namespace {
+
+struct implementation {
+    const char* name;
+    escape::clean_run_fn fn;
+};
+
+std::vector<implementation> implementations() {
+    std::vector<implementation> res;
+#ifdef STREAMLOGGER_HAS_SSE2
+    res.push_back({ "sse2", &escape::clean_run_sse2 });
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) res.push_back({ "avx2", &escape::clean_run_avx2 });
+#endif
+    res.push_back({ "clean_run", &escape::clean_run });
+    return res;
+}
+
+// the input is copied to the end of its own allocation, so a read past it is caught
+// when built with -fsanitize=address
+size_t run(const implementation& impl, const std::string& input, escape::specials sp) {
+    std::unique_ptr<char[]> copy(new char[input.size() + 1]);
+    auto data = copy.get() + 1;
+    std::memcpy(data, input.data(), input.size());
+    return impl.fn(data, input.size(), sp);
+}
+
+void compare(const implementation& impl, const std::string& input, escape::specials sp) {
+    auto expected = escape::clean_run_scalar(input.data(), input.size(), sp);
+    auto actual = run(impl, input, sp);
+    if(actual != expected) {
+        std::fprintf(stderr, "%s: %zu instead of %zu for %zu bytes\n", impl.name, actual, expected, input.size());
+    }
+    CHECK(actual == expected);
+}
+
+void compare_all() {
+    // specials for JSON or text or both, and the clean bytes next to them
+    const char specials[] = { '\0', '\x1f', '"', '\\', '\x7f', '\x80', '\xc3', '\xff' };
+    const char clean[] = { ' ', '!', '#', '[', ']', '~' };
+
+    for(auto&& impl : implementations()) {
+        for(auto sp : { escape::json, escape::text }) {
+            for(size_t size = 0; size <= 140; ++size) {
+                std::string input(size, 'a');
+                for(size_t i = 0; i < size; ++i) input[i] = clean[i % sizeof(clean)];
+                compare(impl, input, sp);
+                for(size_t pos = 0; pos < size; ++pos) {
+                    for(auto special : specials) {
+                        auto hit = input;
+                        hit[pos] = special;
+                        compare(impl, hit, sp);
+                        // the first of two counts
+                        if(pos + 1 < size) {
+                            hit[size - 1] = '\0';
+                            compare(impl, hit, sp);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+size_t sequence(const std::string& input) {
+    return escape::utf8_sequence(input.data(), input.size());
+}
+
+void utf8_sequences() {
+    CHECK(sequence("\xc2\x80") == 2);
+    CHECK(sequence("\xc3\xa9") == 2);
+    CHECK(sequence("\xdf\xbf") == 2);
+    CHECK(sequence("\xe0\xa0\x80") == 3);
+    CHECK(sequence("\xe2\x82\xac") == 3);
+    CHECK(sequence("\xed\x9f\xbf") == 3);     // U+D7FF, just below the surrogates
+    CHECK(sequence("\xee\x80\x80") == 3);     // U+E000, just above them
+    CHECK(sequence("\xf0\x90\x80\x80") == 4);
+    CHECK(sequence("\xf0\x9f\x98\x80") == 4);
+    CHECK(sequence("\xf4\x8f\xbf\xbf") == 4); // U+10FFFF
+
+    // overlong forms
+    CHECK(sequence("\xc0\x80") == 0);
+    CHECK(sequence("\xc1\xbf") == 0);
+    CHECK(sequence("\xe0\x80\xaf") == 0);
+    CHECK(sequence("\xe0\x9f\xbf") == 0);
+    CHECK(sequence("\xf0\x8f\xbf\xbf") == 0);
+    // surrogates
+    CHECK(sequence("\xed\xa0\x80") == 0);
+    CHECK(sequence("\xed\xbf\xbf") == 0);
+    // above U+10FFFF
+    CHECK(sequence("\xf4\x90\x80\x80") == 0);
+    CHECK(sequence("\xf5\x80\x80\x80") == 0);
+    CHECK(sequence("\xff") == 0);
+    // truncated, or not followed by continuation bytes
+    CHECK(sequence("\xc3") == 0);
+    CHECK(sequence("\xe2\x82") == 0);
+    CHECK(sequence("\xf0\x9f\x98") == 0);
+    CHECK(sequence("\xc3\x41") == 0);
+    CHECK(sequence("\xe2\x82\x41") == 0);
+    // a continuation byte on its own
+    CHECK(sequence("\x80") == 0);
+}
+
+std::string json(const std::string& input) {
+    buffer out;
+    out.append_json_escaped(input);
+    return out.str();
+}
+
+std::string sanitized(const std::string& input, size_t max_size = ~size_t(0)) {
+    buffer out;
+    out.append("[", 1);
+    out.append_sanitized(input, max_size);
+    return out.str().substr(1);
+}
+
+const std::string fffd = escape::replacement;
+
+void escaping() {
+    CHECK(json("plain text") == "plain text");
+    CHECK(json("a\"b\\c") == "a\\\"b\\\\c");
+    CHECK(json(std::string("\n\r\t\x01\x1f\0", 6)) == "\\n\\r\\t\\u0001\\u001f\\u0000");
+    CHECK(json("\x7f") == "\x7f");
+    CHECK(json("\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80") == "\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80");
+    CHECK(json("a\xff" "b") == "a" + fffd + "b");
+    CHECK(json("\xc0\xaf") == fffd + fffd);
+    CHECK(json("\xed\xa0\x80") == fffd + fffd + fffd);
+    CHECK(json("\xf4\x90\x80\x80") == fffd + fffd + fffd + fffd);
+    CHECK(json("end\xe2\x82") == "end" + fffd + fffd);
+
+    CHECK(sanitized("line\nnext\r\t") == "line\\nnext\\r\\t");
+    CHECK(sanitized("\x01\x1b[31m\x7f") == "\\x01\\x1b[31m\\x7f");
+    CHECK(sanitized("\"quoted\" \\") == "\"quoted\" \\");
+    CHECK(sanitized("h\xc3\xa9llo") == "h\xc3\xa9llo");
+    CHECK(sanitized("\xc3") == fffd);
+    CHECK(sanitized("\xed\xbf\xbf!") == fffd + fffd + fffd + "!");
+
+    // max_size counts escaped bytes and never splits an escape or a code point
+    CHECK(sanitized("abcdef", 3) == "abc");
+    CHECK(sanitized("abc", 0) == "");
+    CHECK(sanitized("\x01\x02\x03", 10) == "\\x01\\x02");
+    CHECK(sanitized("\x01\x02\x03", 12) == "\\x01\\x02\\x03");
+    CHECK(sanitized("a\nb", 2) == "a");
+    CHECK(sanitized("ab\xc3\xa9", 3) == "ab");
+    CHECK(sanitized("ab\xc3\xa9", 4) == "ab\xc3\xa9");
+    CHECK(sanitized("ab\xff", 4) == "ab");
+    CHECK(sanitized("ab\xff", 5) == "ab" + fffd);
+}
+
+std::string format(const std::string& layout, const char* category) {
+    message_info mi;
+    mi.category = category;
+    buffer out;
+    pattern::parse(layout).print_prefix(out, &mi);
+    return out.str();
+}
+
+// %.N limits the escaped text, not the input
+void widths() {
+    CHECK(format("%.10c|", "\x01\x02\x03\x04") == "\\x01\\x02|");
+    CHECK(format("%.3c|", "h\xc3\xa9llo") == "h\xc3\xa9|");
+    CHECK(format("%.2c|", "h\xc3\xa9llo") == "h|");
+    CHECK(format("%.4c|", "net.tcp") == "net.|");
+    CHECK(format("%c|", "\x01\x02\x03\x04") == "\\x01\\x02\\x03\\x04|");
+}
+
+} // namespace
+
+int main() {
+    compare_all();
+    utf8_sequences();
+    escaping();
+    widths();
+    return 0;
+}
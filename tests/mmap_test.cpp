@@ -0,0 +1,90 @@
+// mmap_file_sink reopening an existing file, including when the first window cannot be
+// mapped: the records already there must be neither overwritten nor cut off.
+
+#include <streamlogger/configurator.h>
+
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include <sys/resource.h>
+
+#include "check.h"
+
+using namespace streamlogger;
+
+namespace {
+
+const char* file_name = "mmap_test.log";
+
+std::string read_file() {
+    std::ifstream in(file_name, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void write(sink& s, const std::string& text) {
+    message_info mi;
+    s.write(mi, text);
+}
+
+// fallocate(2) past the limit fails with EFBIG instead of raising SIGXFSZ
+void limit_file_size(rlim_t size) {
+    rlimit limit;
+    CHECK(::getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    limit.rlim_cur = size;
+    CHECK(::setrlimit(RLIMIT_FSIZE, &limit) == 0);
+}
+
+} // namespace
+
+int main() {
+    std::signal(SIGXFSZ, SIG_IGN);
+    rlimit original;
+    CHECK(::getrlimit(RLIMIT_FSIZE, &original) == 0);
+    std::remove(file_name);
+
+    {
+        mmap_file_sink s(file_name, 4096);
+        write(s, "first\n");
+    }
+    CHECK(read_file() == "first\n");
+
+    // reopened, the sink appends after the data and not after the preallocated zeros
+    {
+        mmap_file_sink s(file_name, 4096);
+        write(s, "second\n");
+    }
+    CHECK(read_file() == "first\nsecond\n");
+
+    // the window cannot be reserved: nothing is written, nothing is lost
+    limit_file_size(1024);
+    {
+        mmap_file_sink s(file_name, 4096);
+        CHECK(s.stats().errors == 1);
+        write(s, "lost\n");
+        CHECK(s.stats().errors == 2);
+    }
+    CHECK(::setrlimit(RLIMIT_FSIZE, &original) == 0);
+    CHECK(read_file() == "first\nsecond\n");
+
+    // and once it can, records go after the existing ones
+    limit_file_size(1024);
+    {
+        mmap_file_sink s(file_name, 4096);
+        CHECK(::setrlimit(RLIMIT_FSIZE, &original) == 0);
+        write(s, "third\n");
+        CHECK(s.stats().maps == 1);
+    }
+    CHECK(read_file() == "first\nsecond\nthird\n");
+
+    // records spanning windows
+    std::string big(10000, 'x');
+    {
+        mmap_file_sink s(file_name, 4096);
+        write(s, big);
+    }
+    CHECK(read_file() == "first\nsecond\nthird\n" + big);
+    return 0;
+}
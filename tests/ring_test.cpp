@@ -0,0 +1,175 @@
+// byte_ring with several producers and one consumer, and concurrent_sink in front of a
+// sink that checks what arrives. Records have varying sizes and the rings are small, so
+// reservations wrap around and records are split by the end of the ring.
+
+#include <streamlogger/concurrent_sink.h>
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+
+using namespace streamlogger;
+
+namespace {
+
+constexpr std::uint32_t producers = 4;
+constexpr std::uint32_t records_per_producer = 20000;
+
+struct record_id {
+    std::uint32_t producer;
+    std::uint32_t sequence;
+};
+
+std::string make_record(std::uint32_t producer, std::uint32_t sequence) {
+    record_id id{ producer, sequence };
+    std::string res(reinterpret_cast<const char*>(&id), sizeof(id));
+    auto size = sequence * 7 % 300;
+    for(std::uint32_t i = 0; i < size; ++i) res += static_cast<char>(producer * 31 + sequence + i);
+    return res;
+}
+
+// Checks one record and that each producer's records arrive in order; with gaps
+// allowed, records may be missing (dropped by try_write) but never reordered.
+class verifier {
+    std::vector<std::int64_t> last = std::vector<std::int64_t>(producers, -1);
+
+public:
+    size_t received = 0;
+
+    void check(const char* data, size_t size, bool gaps) {
+        CHECK(size >= sizeof(record_id));
+        record_id id;
+        std::memcpy(&id, data, sizeof(id));
+        CHECK(id.producer < producers);
+        CHECK(std::string(data, size) == make_record(id.producer, id.sequence));
+        if(gaps) CHECK(static_cast<std::int64_t>(id.sequence) > last[id.producer]);
+        else CHECK(static_cast<std::int64_t>(id.sequence) == last[id.producer] + 1);
+        last[id.producer] = id.sequence;
+        ++received;
+    }
+
+    bool complete() const {
+        for(auto l : last) {
+            if(l != records_per_producer - 1) return false;
+        }
+        return true;
+    }
+};
+
+void ring_stress(bool blocking) {
+    const size_t capacity = 4096;
+    std::unique_ptr<char[]> memory(new char[byte_ring::memory_size(capacity)]());
+    byte_ring ring(memory.get(), capacity, true);
+
+    std::vector<std::thread> threads;
+    for(std::uint32_t p = 0; p < producers; ++p) {
+        threads.emplace_back([&ring, p, blocking]{
+            for(std::uint32_t s = 0; s < records_per_producer; ++s) {
+                auto rec = make_record(p, s);
+                if(blocking) CHECK(ring.write(rec.data(), rec.size(), p));
+                else ring.try_write(rec.data(), rec.size(), p);
+            }
+        });
+    }
+
+    verifier v;
+    std::uint64_t total = std::uint64_t(producers) * records_per_producer;
+    auto on_record = [&](std::uint32_t tag, const char* data, size_t size) {
+        v.check(data, size, not blocking);
+        record_id id;
+        std::memcpy(&id, data, sizeof(id));
+        CHECK(tag == id.producer);
+    };
+    while(v.received + ring.dropped() < total) {
+        if(ring.consume(on_record) == 0) std::this_thread::yield();
+    }
+    for(auto&& t : threads) t.join();
+    CHECK(ring.consume(on_record) == 0);
+
+    CHECK(v.received + ring.dropped() == total);
+    if(blocking) {
+        CHECK(ring.dropped() == 0);
+        CHECK(v.complete());
+    }
+    CHECK(ring.reserved() == ring.released());
+}
+
+// records too large for the ring are refused, not truncated
+void oversized() {
+    const size_t capacity = 4096;
+    std::unique_ptr<char[]> memory(new char[byte_ring::memory_size(capacity)]());
+    byte_ring ring(memory.get(), capacity, true);
+    std::string big(ring.max_record(), 'x');
+    CHECK(not ring.write(big.data(), big.size()));
+    CHECK(not ring.try_write(big.data(), big.size()));
+    CHECK(ring.dropped() == 2);
+    CHECK(ring.try_write("ok", 2));
+    size_t seen = 0;
+    ring.consume([&](std::uint32_t, const char* data, size_t size) {
+        CHECK(std::string(data, size) == "ok");
+        ++seen;
+    });
+    CHECK(seen == 1);
+}
+
+// splits each batch back into records, which only works because every record
+// starts with its size here
+class checking_sink: public sink {
+    void handle_start(const message_info&) override {}
+    void handle_end(const message_info&) override {}
+
+    void output(const message_info&, const char* data, size_t size) override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        while(size > 0) {
+            std::uint32_t length;
+            CHECK(size >= sizeof(length));
+            std::memcpy(&length, data, sizeof(length));
+            CHECK(size >= sizeof(length) + length);
+            v.check(data + sizeof(length), length, false);
+            data += sizeof(length) + length;
+            size -= sizeof(length) + length;
+        }
+    }
+
+public:
+    verifier v;
+};
+
+void concurrent_sink_stress() {
+    auto target = std::make_shared<checking_sink>();
+    {
+        concurrent_sink front(target, 4096);
+        std::vector<std::thread> threads;
+        for(std::uint32_t p = 0; p < producers; ++p) {
+            threads.emplace_back([&front, p]{
+                message_info mi;
+                for(std::uint32_t s = 0; s < records_per_producer; ++s) {
+                    auto rec = make_record(p, s);
+                    auto length = static_cast<std::uint32_t>(rec.size());
+                    rec.insert(0, reinterpret_cast<const char*>(&length), sizeof(length));
+                    front.write(mi, rec);
+                }
+            });
+        }
+        for(auto&& t : threads) t.join();
+        front.flush();
+        CHECK(front.dropped() == 0);
+    }
+    CHECK(target->v.complete());
+}
+
+} // namespace
+
+int main() {
+    ring_stress(true);
+    ring_stress(false);
+    oversized();
+    concurrent_sink_stress();
+    return 0;
+}
@@ -0,0 +1,91 @@
+// Records written into an anonymous shm_ring_sink by a forked child reach the collector's
+// sinks with their level, time and category.
+
+#include <streamlogger/shm_sink.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "check.h"
+
+using namespace streamlogger;
+
+namespace {
+
+struct received {
+    level lvl;
+    std::uint64_t ns;
+    std::string category;
+    std::string text;
+};
+
+class capturing_sink: public sink {
+    void handle_start(const message_info&) override {}
+    void handle_end(const message_info&) override {}
+
+    void output(const message_info& mi, const char* data, size_t size) override {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        records.push_back({ mi.level, mi.time_point.ticks, mi.category, std::string(data, size) });
+    }
+
+public:
+    std::vector<received> records;
+
+    size_t count() {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        return records.size();
+    }
+};
+
+constexpr int records = 1000;
+const std::uint64_t base_ns = 1700000000123456789ull;
+
+std::string category_of(int i) {
+    if(i % 3 == 0) return "";
+    if(i % 3 == 1) return "net.tcp";
+    return std::string(300, 'c'); // longer than max_category
+}
+
+} // namespace
+
+int main() {
+    auto target = std::make_shared<capturing_sink>();
+    {
+        shm_ring_sink ring;
+        CHECK(ring.is_open());
+
+        auto pid = ::fork();
+        CHECK(pid >= 0);
+        if(pid == 0) {
+            for(int i = 0; i < records; ++i) {
+                auto category = category_of(i);
+                message_info mi;
+                mi.level = i % 2 ? level::WARN : level::DEBUG;
+                mi.category = category.c_str();
+                mi.time_point.ticks = base_ns + static_cast<std::uint64_t>(i);
+                mi.time_point.source = clock_source::REALTIME;
+                ring.write(mi, "record " + std::to_string(i) + "\n");
+            }
+            ::_exit(0);
+        }
+        int status = 0;
+        CHECK(::waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        CHECK(ring.dropped() == 0);
+        ring.collect_into({ target });
+    }
+
+    CHECK(target->count() == records);
+    for(int i = 0; i < records; ++i) {
+        auto&& r = target->records[static_cast<size_t>(i)];
+        CHECK(r.lvl == (i % 2 ? level::WARN : level::DEBUG));
+        CHECK(r.ns == base_ns + static_cast<std::uint64_t>(i));
+        CHECK(r.category == category_of(i).substr(0, 255));
+        CHECK(r.text == "record " + std::to_string(i) + "\n");
+    }
+    return 0;
+}
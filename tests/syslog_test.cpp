@@ -0,0 +1,173 @@
+// syslog_sink against a unix datagram socket bound in a temporary directory: frames are
+// checked byte for byte, batches are counted, and a receiver that never reads makes the
+// sink drop frames instead of blocking.
+
+#include <streamlogger/syslog_sink.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "check.h"
+
+using namespace streamlogger;
+
+namespace {
+
+class receiver {
+    int fd;
+
+public:
+    std::string path;
+
+    explicit receiver(const std::string& path): fd(::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)), path(path) {
+        CHECK(fd >= 0);
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        CHECK(path.size() < sizeof(addr.sun_path));
+        std::strcpy(addr.sun_path, path.c_str());
+        CHECK(::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    }
+
+    ~receiver() {
+        ::close(fd);
+        ::unlink(path.c_str());
+    }
+
+    // every datagram waiting to be read
+    std::vector<std::string> receive() {
+        std::vector<std::string> res;
+        char data[65536];
+        for(;;) {
+            auto size = ::recv(fd, data, sizeof(data), MSG_DONTWAIT);
+            if(size < 0) break;
+            res.emplace_back(data, static_cast<size_t>(size));
+        }
+        return res;
+    }
+};
+
+// 2023-11-14T22:13:20.123456789Z
+message_info make_info(level lvl, const char* category) {
+    message_info mi;
+    mi.level = lvl;
+    mi.category = category;
+    mi.time_point.ticks = 1700000000123456789ull;
+    mi.time_point.source = clock_source::REALTIME;
+    return mi;
+}
+
+void send(sink& s, const message_info& mi, const std::string& text) {
+    s.write(mi, text);
+}
+
+std::string hostname() {
+    char name[256] = {0};
+    CHECK(::gethostname(name, sizeof(name) - 1) == 0);
+    return name;
+}
+
+void frames(const std::string& dir) {
+    receiver r(dir + "/frames");
+    auto pid = std::to_string(::getpid());
+
+    syslog_sink::options opts;
+    opts.path = r.path;
+    opts.app_name = "my app";
+    opts.batch = 1;
+    {
+        syslog_sink s(opts);
+        send(s, make_info(level::INFO, "net.tcp"), "hello\n");
+        send(s, make_info(level::ERROR, ""), "no msgid");
+        send(s, make_info(level::WARN, "a category\tlonger than thirty-two characters"), "x");
+        CHECK(s.stats().sent == 3 && s.stats().dropped == 0);
+    }
+    auto got = r.receive();
+    CHECK(got.size() == 3);
+    auto header = "2023-11-14T22:13:20.123456+00:00 " + hostname() + " my_app " + pid + " ";
+    CHECK(got[0] == "<14>1 " + header + "net.tcp - hello");
+    CHECK(got[1] == "<11>1 " + header + "- - no msgid");
+    CHECK(got[2] == "<12>1 " + header + "a_category_longer_than_thirty-tw - x");
+
+    opts.frame = syslog_sink::format::RFC3164;
+    opts.facility = 16;
+    opts.app_name = "a tag that is far longer than thirty-two characters";
+    {
+        syslog_sink s(opts);
+        send(s, make_info(level::FATAL, "net"), "down\n");
+    }
+    got = r.receive();
+    CHECK(got.size() == 1);
+    CHECK(got[0] == "<130>Nov 14 22:13:20 " + hostname() + " a_tag_that_is_far_longer_than_th[" + pid + "]: down");
+}
+
+void batches(const std::string& dir) {
+    receiver r(dir + "/batches");
+    syslog_sink::options opts;
+    opts.path = r.path;
+    opts.batch = 4;
+    syslog_sink s(opts);
+    for(int i = 0; i < 10; ++i) send(s, make_info(level::INFO, "b"), std::to_string(i));
+    // two full batches went out on their own; the rest waits for flush()
+    CHECK(s.stats().batches == 2 && s.stats().sent == 8);
+    CHECK(r.receive().size() == 8);
+    s.flush();
+    auto stats = s.stats();
+    CHECK(stats.batches == 3 && stats.sent == 10 && stats.dropped == 0);
+    auto got = r.receive();
+    CHECK(got.size() == 2);
+    CHECK(got[0].compare(got[0].size() - 2, 2, " 8") == 0);
+    CHECK(got[1].compare(got[1].size() - 2, 2, " 9") == 0);
+
+    // an ERROR (policy.immediate by default) goes out at once
+    send(s, make_info(level::ERROR, "b"), "now");
+    CHECK(s.stats().sent == 11);
+}
+
+void drops(const std::string& dir) {
+    receiver r(dir + "/drops");
+    syslog_sink::options opts;
+    opts.path = r.path;
+    opts.batch = 16;
+    syslog_sink s(opts);
+    const size_t records = 5000;
+    std::string text(512, 'x');
+    for(size_t i = 0; i < records; ++i) send(s, make_info(level::INFO, "d"), text);
+    s.flush();
+    auto stats = s.stats();
+    CHECK(stats.dropped > 0);
+    CHECK(stats.sent + stats.dropped == records);
+    CHECK(stats.errors == 0);
+    CHECK(r.receive().size() == stats.sent);
+
+    // nobody listening: counted as errors and drops
+    syslog_sink::options missing;
+    missing.path = dir + "/missing";
+    syslog_sink lost(missing);
+    send(lost, make_info(level::ERROR, "d"), "lost");
+    CHECK(lost.stats().errors == 1 && lost.stats().dropped == 1 && lost.stats().sent == 0);
+}
+
+} // namespace
+
+int main() {
+    // frames carry local time
+    ::setenv("TZ", "UTC", 1);
+    ::tzset();
+
+    char dir[] = "/tmp/syslog_test.XXXXXX";
+    CHECK(::mkdtemp(dir));
+    frames(dir);
+    batches(dir);
+    drops(dir);
+    ::rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,280 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define STREAMLOGGER_HAS_TSC 1
+#endif
+
+#include "lib/date/date.h"
+
+#include "common.h"
+#include "buffer.h"
+
+namespace streamlogger {
+
+class clock {
+    struct calibration {
+        std::uint64_t base_ticks;
+        std::int64_t base_ns;
+        double ns_per_tick;
+    };
+
+    static std::atomic<clock_source>& current() {
+        static std::atomic<clock_source> result{ clock_source::REALTIME };
+        return result;
+    }
+
+    static std::int64_t realtime_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()
+        ).count();
+    }
+
+#ifdef STREAMLOGGER_HAS_TSC
+    // The current calibration, published under a sequence lock: readers retry while
+    // sequence is odd or changes underneath them.
+    struct tsc_state {
+        std::atomic<std::uint32_t> sequence{ 0 };
+        std::atomic<std::uint64_t> base_ticks{ 0 };
+        std::atomic<std::int64_t> base_ns{ 0 };
+        std::atomic<double> ns_per_tick{ 0 };
+        std::atomic<bool> updating{ false };
+    };
+
+    // how often conversions re-anchor the TSC to CLOCK_REALTIME
+    static constexpr std::int64_t recalibration_ns = 1000000000;
+
+    // Measured over 20ms on the first switch to clock_source::TSC, assuming an invariant
+    // TSC. Never destroyed: records may be rendered during static destruction.
+    static tsc_state& tsc_calibration() {
+        static tsc_state* result = []{
+            auto ns0 = realtime_ns();
+            auto tsc0 = __rdtsc();
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            auto ns1 = realtime_ns();
+            auto tsc1 = __rdtsc();
+            auto state = new tsc_state();
+            state->base_ticks.store(tsc1, std::memory_order_relaxed);
+            state->base_ns.store(ns1, std::memory_order_relaxed);
+            state->ns_per_tick.store(double(ns1 - ns0) / double(tsc1 - tsc0), std::memory_order_relaxed);
+            return state;
+        }();
+        return *result;
+    }
+
+    static calibration tsc_snapshot(const tsc_state& state) {
+        calibration res;
+        std::uint32_t before, after;
+        do {
+            before = state.sequence.load(std::memory_order_acquire);
+            res.base_ticks = state.base_ticks.load(std::memory_order_relaxed);
+            res.base_ns = state.base_ns.load(std::memory_order_relaxed);
+            res.ns_per_tick = state.ns_per_tick.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = state.sequence.load(std::memory_order_relaxed);
+        } while(before != after || (before & 1));
+        return res;
+    }
+
+    // Moves the base to the current CLOCK_REALTIME, so that the wall clock is followed as
+    // NTP adjusts it, and measures the rate again over the interval since the last base.
+    // One thread at a time; the others keep converting with the previous calibration.
+    static void tsc_recalibrate(tsc_state& state, const calibration& old) {
+        if(state.updating.exchange(true, std::memory_order_acquire)) return;
+        auto ns = realtime_ns();
+        auto ticks = __rdtsc();
+        auto rate = double(ns - old.base_ns) / double(ticks - old.base_ticks);
+        // the wall clock was stepped: the interval says nothing about the rate
+        if(not (rate > old.ns_per_tick * 0.99 && rate < old.ns_per_tick * 1.01)) rate = old.ns_per_tick;
+
+        auto sequence = state.sequence.load(std::memory_order_relaxed);
+        state.sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        state.base_ticks.store(ticks, std::memory_order_relaxed);
+        state.base_ns.store(ns, std::memory_order_relaxed);
+        state.ns_per_tick.store(rate, std::memory_order_relaxed);
+        state.sequence.store(sequence + 2, std::memory_order_release);
+        state.updating.store(false, std::memory_order_release);
+    }
+#endif
+
+public:
+    // TSC falls back to REALTIME where there is no cycle counter
+    static void set_source(clock_source source) {
+#ifdef STREAMLOGGER_HAS_TSC
+        if(source == clock_source::TSC) tsc_calibration();
+#else
+        if(source == clock_source::TSC) source = clock_source::REALTIME;
+#endif
+        current().store(source, std::memory_order_release);
+    }
+
+    static clock_source source() {
+        return current().load(std::memory_order_acquire);
+    }
+
+    static timestamp now() {
+        auto source = current().load(std::memory_order_acquire);
+        switch(source) {
+#ifdef STREAMLOGGER_HAS_TSC
+            case clock_source::TSC:
+                return { __rdtsc(), source };
+#endif
+#ifdef CLOCK_REALTIME_COARSE
+            case clock_source::REALTIME_COARSE: {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+                return { std::uint64_t(ts.tv_sec) * 1000000000u + std::uint64_t(ts.tv_nsec), source };
+            }
+#endif
+            default:
+                return { std::uint64_t(realtime_ns()), clock_source::REALTIME };
+        }
+    }
+
+    static std::chrono::system_clock::time_point to_time_point(const timestamp& ts) {
+        using namespace std::chrono;
+        std::int64_t ns = static_cast<std::int64_t>(ts.ticks);
+#ifdef STREAMLOGGER_HAS_TSC
+        if(ts.source == clock_source::TSC) {
+            auto&& state = tsc_calibration();
+            auto cal = tsc_snapshot(state);
+            if(static_cast<double>(static_cast<std::int64_t>(__rdtsc() - cal.base_ticks)) * cal.ns_per_tick > recalibration_ns) {
+                tsc_recalibrate(state, cal);
+                cal = tsc_snapshot(state);
+            }
+            auto delta = static_cast<double>(static_cast<std::int64_t>(ts.ticks - cal.base_ticks));
+            ns = cal.base_ns + static_cast<std::int64_t>(delta * cal.ns_per_tick);
+        }
+#endif
+        return system_clock::time_point(duration_cast<system_clock::duration>(nanoseconds(ns)));
+    }
+};
+
+inline clock_source parse_clock_source(essentials::string_view sv) {
+    if(sv == "coarse") return clock_source::REALTIME_COARSE;
+    if(sv == "tsc") return clock_source::TSC;
+    return clock_source::REALTIME;
+}
+
+// A strftime-like date format (as understood by date::format) split once at every %S/%T.
+// The whole-second text is rendered at most once per second per thread;
+// sub-second digits are patched in after each split point.
+class timestamp_format {
+    using clock = std::chrono::system_clock;
+    using fraction = date::detail::decimal_format_seconds<clock::duration>;
+
+public:
+    enum class zone { LOCAL, UTC };
+
+private:
+    // every segment but the last is followed by the sub-second digits
+    std::vector<std::string> segments;
+    std::uint64_t id;
+    size_t digits_;
+    zone zone_;
+
+    struct cache_entry {
+        std::uint64_t id = 0;
+        std::int64_t second = 0;
+        std::string text;
+        std::vector<size_t> cuts;
+    };
+
+    static constexpr size_t cache_size = 8;
+
+    static cache_entry& cache_for(std::uint64_t id) {
+        static thread_local cache_entry cache[cache_size];
+        return cache[id % cache_size];
+    }
+
+    static std::uint64_t next_id() {
+        static std::atomic<std::uint64_t> counter{0};
+        return ++counter;
+    }
+
+    void fill(cache_entry& entry, std::chrono::time_point<clock, std::chrono::seconds> tp) const {
+        entry.text.clear();
+        entry.cuts.clear();
+        for(auto&& seg : segments) {
+            entry.text += date::format(seg, tp);
+            entry.cuts.push_back(entry.text.size());
+        }
+        entry.cuts.pop_back();
+    }
+
+public:
+    // digits: sub-second digits written after %S/%T, at most the clock's resolution
+    explicit timestamp_format(const std::string& fmt, size_t digits = fraction::width, zone z = zone::LOCAL):
+        id(next_id()),
+        digits_(digits < fraction::width ? digits : fraction::width),
+        zone_(z) {
+        std::string current;
+        for(size_t i = 0; i < fmt.size(); ++i) {
+            current += fmt[i];
+            if(fmt[i] != '%' || i + 1 == fmt.size()) continue;
+
+            char modifier = fmt[i + 1];
+            if(modifier == 'E' || modifier == 'O') current += fmt[++i];
+            if(i + 1 == fmt.size()) continue;
+
+            char command = fmt[++i];
+            current += command;
+            if((command == 'S' || command == 'T') && modifier != 'E' && modifier != 'O') {
+                segments.push_back(current);
+                current.clear();
+            }
+        }
+        segments.push_back(current);
+    }
+
+    // writes tp (a UTC time point) as local time or as UTC
+    void render(buffer& out, clock::time_point tp) const {
+        using namespace std::chrono;
+
+        auto local = zone_ == zone::UTC ? tp : tp + util::local_tz_offset();
+        auto whole = date::floor<seconds>(local);
+        auto&& entry = cache_for(id);
+        if(entry.id != id || entry.second != whole.time_since_epoch().count()) {
+            fill(entry, whole);
+            entry.id = id;
+            entry.second = whole.time_since_epoch().count();
+        }
+
+        if(entry.cuts.empty() || digits_ == 0) {
+            out.append(entry.text.data(), entry.text.size());
+            return;
+        }
+
+        char digits[24];
+        auto size = static_cast<size_t>(fraction::width) + 1;
+        auto sub = duration_cast<fraction::precision>(local - whole).count();
+        digits[0] = '.';
+        for(size_t i = size - 1; i > 0; --i) {
+            digits[i] = static_cast<char>('0' + sub % 10);
+            sub /= 10;
+        }
+        // truncated, not rounded, so the second never changes
+        size = digits_ + 1;
+
+        size_t from = 0;
+        for(auto cut : entry.cuts) {
+            out.append(entry.text.data() + from, cut - from);
+            out.append(digits, size);
+            from = cut;
+        }
+        out.append(entry.text.data() + from, entry.text.size() - from);
+    }
+};
+
+} /* namespace streamlogger */
+
+#endif // TIMESTAMP_H
@@ -0,0 +1,318 @@
+// Decodes binary logs written by deferred::backend::write_binary back into text.
+//
+//     decoder [options] input.slb
+//       -c, --config FILE      INI file to take the layout from
+//       -a, --appender NAME    appender in that file whose ConversionPattern and threshold
+//                              are used (default: A)
+//       -p, --pattern PATTERN  layout to use instead of an INI file
+//       -j, --json             one JSON object per record instead of text
+//       -t, --threads N        decoding threads (default: hardware concurrency)
+//       -o, --output FILE      output file (default: stdout)
+//
+// The file is read one chunk at a time and at most a few chunks per thread are in
+// flight, so memory use does not depend on the size of the log. Record chunks are
+// decoded in parallel and written out in file order.
+
+#include <streamlogger/binary_log.h>
+#include <streamlogger/formatter.h>
+#include <streamlogger/lib/inih/INIReader.h>
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace streamlogger;
+
+namespace {
+
+struct options {
+    std::string config;
+    std::string appender = "A";
+    std::string pattern = "%d %p %c - %m%n";
+    level threshold = level::ALL;
+    bool json = false;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string input;
+    std::string output;
+};
+
+// sites by id; replaced, never modified, once jobs refer to it
+using site_table = std::vector<std::shared_ptr<const binlog::site_info>>;
+
+struct job {
+    std::string input;
+    std::shared_ptr<const site_table> sites;
+    std::uint32_t count = 0;
+    std::string output;
+    bool taken = false;
+    bool done = false;
+};
+
+class decoder {
+    const options& opts;
+    pattern layout;
+    timestamp_format json_time{ "%FT%TZ", 9, timestamp_format::zone::UTC };
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::shared_ptr<job>> jobs;
+    bool finished = false;
+    std::uint64_t bad_records = 0;
+
+    void append_json(buffer& out, const binlog::site_info& site, std::uint32_t thread, std::uint64_t ns, buffer& message) {
+        timestamp ts;
+        ts.ticks = ns;
+        out.append("{\"time\":\"", 9);
+        json_time.render(out, clock::to_time_point(ts));
+        out.append("\",\"ns\":", 7);
+        out.append_integer(ns);
+        out.append(",\"level\":\"", 10);
+        out.append(pattern::priorityName(site.lvl));
+        out.append("\",\"category\":\"", 14);
+        out.append_json_escaped(site.category);
+        out.append("\",\"thread\":", 11);
+        out.append_integer(thread);
+        out.append(",\"file\":\"", 9);
+        out.append_json_escaped(site.file);
+        out.append("\",\"line\":", 9);
+        out.append_integer(site.line);
+        out.append(",\"function\":\"", 13);
+        out.append_json_escaped(site.function);
+        out.append("\",\"message\":\"", 13);
+        out.append_json_escaped(message.view());
+        out.append("\"}\n", 3);
+    }
+
+    // renders every record of a RECORDS chunk
+    void decode(job& j) {
+        buffer out;
+        buffer message;
+        binlog::reader in(j.input.data(), j.input.size());
+        message_info mi;
+        for(std::uint32_t i = 0; i < j.count && in.ok(); ++i) {
+            auto id = in.get<std::uint32_t>();
+            auto thread = in.get<std::uint32_t>();
+            auto ns = in.get<std::uint64_t>();
+            auto size = in.get<std::uint32_t>();
+            auto args = in.bytes(size);
+            if(not in.ok()) break;
+
+            if(id >= j.sites->size() || not (*j.sites)[id]) {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++bad_records;
+                continue;
+            }
+            auto&& site = *(*j.sites)[id];
+            if(site.lvl < opts.threshold) continue;
+
+            message.clear();
+            binlog::reader arg_reader(args.data(), args.size());
+            if(not binlog::render(site, arg_reader, message)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++bad_records;
+                continue;
+            }
+
+            if(opts.json) {
+                append_json(out, site, thread, ns, message);
+                continue;
+            }
+            mi.category = site.category.c_str();
+            mi.caller = site.function.c_str();
+            mi.caller_location.file = site.file.c_str();
+            mi.caller_location.line = site.line;
+            mi.level = site.lvl;
+            mi.time_point.ticks = ns;
+            mi.time_point.source = clock_source::REALTIME;
+            layout.print_prefix(out, &mi);
+            out.append(message.view());
+            layout.print_suffix(out, &mi);
+        }
+        j.output = out.str();
+        j.input = std::string();
+    }
+
+    void work() {
+        for(;;) {
+            std::shared_ptr<job> next;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]{
+                    if(finished) return true;
+                    for(auto&& j : jobs) if(not j->taken) return true;
+                    return false;
+                });
+                for(auto&& j : jobs) {
+                    if(not j->taken) {
+                        next = j;
+                        break;
+                    }
+                }
+                if(not next) return;
+                next->taken = true;
+            }
+            decode(*next);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                next->done = true;
+            }
+            changed.notify_all();
+        }
+    }
+
+    static bool read_fully(std::FILE* in, void* data, size_t size) {
+        return std::fread(data, 1, size, in) == size;
+    }
+
+    // writes out finished jobs from the front until at most limit remain
+    bool write_done(std::FILE* out, size_t limit) {
+        for(;;) {
+            std::shared_ptr<job> front;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if(jobs.size() <= limit) return true;
+                changed.wait(lock, [&]{ return jobs.front()->done; });
+                front = jobs.front();
+                jobs.pop_front();
+            }
+            if(std::fwrite(front->output.data(), 1, front->output.size(), out) != front->output.size()) return false;
+        }
+    }
+
+public:
+    explicit decoder(const options& opts): opts(opts), layout(pattern::parse(opts.pattern)) {}
+
+    int run(std::FILE* in, std::FILE* out) {
+        char magic[binlog::magic_size];
+        if(not read_fully(in, magic, sizeof(magic)) || std::memcmp(magic, binlog::magic, binlog::magic_size) != 0) {
+            std::cerr << "not a binary log: " << opts.input << "\n";
+            return 1;
+        }
+
+        std::vector<std::thread> workers;
+        for(unsigned i = 0; i < opts.threads; ++i) workers.emplace_back([this]{ work(); });
+
+        auto sites = std::make_shared<site_table>();
+        size_t in_flight = opts.threads * 4;
+        bool ok = true;
+        bool corrupt = false;
+        binlog::chunk_header header;
+        while(read_fully(in, &header, sizeof(header))) {
+            // nothing after a bad size can be trusted, not even where the next chunk starts
+            if(header.size > binlog::max_chunk_size) {
+                std::cerr << "corrupt chunk header in " << opts.input << ": " << header.size << " bytes\n";
+                corrupt = true;
+                break;
+            }
+            std::string payload(header.size, '\0');
+            if(not read_fully(in, &payload[0], payload.size())) {
+                std::cerr << "truncated chunk at the end of " << opts.input << "\n";
+                break;
+            }
+
+            if(header.type == static_cast<std::uint32_t>(binlog::chunk_type::SITES)) {
+                auto next = std::make_shared<site_table>(*sites);
+                binlog::reader reader(payload.data(), payload.size());
+                for(std::uint32_t i = 0; i < header.count; ++i) {
+                    auto site = std::make_shared<binlog::site_info>(binlog::read_site(reader));
+                    if(not reader.ok()) break;
+                    if(not site->valid) continue; // its records count as bad
+                    if(next->size() <= site->id) next->resize(site->id + 1);
+                    (*next)[site->id] = std::move(site);
+                }
+                sites = std::move(next);
+                continue;
+            }
+            if(header.type != static_cast<std::uint32_t>(binlog::chunk_type::RECORDS)) continue;
+
+            auto j = std::make_shared<job>();
+            j->input = std::move(payload);
+            j->sites = sites;
+            j->count = header.count;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                jobs.push_back(std::move(j));
+            }
+            changed.notify_all();
+            if(not write_done(out, in_flight)) {
+                ok = false;
+                break;
+            }
+        }
+        ok = ok && write_done(out, 0);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished = true;
+        }
+        changed.notify_all();
+        for(auto&& w : workers) w.join();
+
+        if(bad_records != 0) std::cerr << bad_records << " records were malformed or refer to unknown sites\n";
+        if(not ok) std::cerr << "cannot write output\n";
+        return ok && not corrupt ? 0 : 1;
+    }
+};
+
+int usage() {
+    std::cerr << "usage: decoder [-c config.ini] [-a appender] [-p pattern] [-j] [-t threads] [-o output] input\n";
+    return 2;
+}
+
+} /* namespace */
+
+int main(int argc, char** argv) {
+    options opts;
+    for(int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> const char* { return i + 1 < argc ? argv[++i] : nullptr; };
+        const char* v = nullptr;
+        if(arg == "-j" || arg == "--json") opts.json = true;
+        else if(arg == "-c" || arg == "--config") { if(not (v = value())) return usage(); opts.config = v; }
+        else if(arg == "-a" || arg == "--appender") { if(not (v = value())) return usage(); opts.appender = v; }
+        else if(arg == "-p" || arg == "--pattern") { if(not (v = value())) return usage(); opts.pattern = v; }
+        else if(arg == "-t" || arg == "--threads") { if(not (v = value())) return usage(); opts.threads = std::max(1, std::atoi(v)); }
+        else if(arg == "-o" || arg == "--output") { if(not (v = value())) return usage(); opts.output = v; }
+        else if(not arg.empty() && arg[0] == '-') return usage();
+        else opts.input = arg;
+    }
+    if(opts.input.empty()) return usage();
+
+    if(not opts.config.empty()) {
+        INIReader ini(opts.config);
+        if(ini.ParseError() < 0) {
+            std::cerr << "cannot read " << opts.config << "\n";
+            return 1;
+        }
+        auto prefix = "appender." + opts.appender;
+        auto layout = ini.Get("", prefix + ".layout.ConversionPattern", "");
+        if(layout.empty()) {
+            std::cerr << "no layout for appender " << opts.appender << " in " << opts.config << "\n";
+            return 1;
+        }
+        opts.pattern = layout;
+        opts.threshold = parse_level(ini.Get("", prefix + ".threshold", "").c_str());
+    }
+
+    std::FILE* in = std::fopen(opts.input.c_str(), "rb");
+    if(not in) {
+        std::cerr << "cannot open " << opts.input << "\n";
+        return 1;
+    }
+    std::FILE* out = opts.output.empty() ? stdout : std::fopen(opts.output.c_str(), "wb");
+    if(not out) {
+        std::cerr << "cannot open " << opts.output << "\n";
+        return 1;
+    }
+
+    int res = decoder(opts).run(in, out);
+    std::fclose(in);
+    if(std::fclose(out) != 0) res = 1;
+    return res;
+}
@@ -0,0 +1,467 @@
+#ifndef URING_SINK_H
+#define URING_SINK_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "sink.h"
+
+namespace streamlogger {
+
+// The minimum of io_uring needed to keep writes in flight, without liburing.
+class uring {
+    int ring_fd = -1;
+
+    void* sq_map = nullptr;
+    size_t sq_map_size = 0;
+    void* cq_map = nullptr;
+    size_t cq_map_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_entries = 0;
+
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    template<class T>
+    static T* at(void* base, std::uint32_t offset) {
+        return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+    }
+
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+        for(;;) {
+            auto res = ::syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+            if(res >= 0 || errno != EINTR) return static_cast<int>(res);
+        }
+    }
+
+    void destroy() {
+        if(sqes) ::munmap(sqes, sqes_size);
+        if(cq_map && cq_map != sq_map) ::munmap(cq_map, cq_map_size);
+        if(sq_map) ::munmap(sq_map, sq_map_size);
+        if(ring_fd >= 0) ::close(ring_fd);
+        sqes = nullptr;
+        sq_map = cq_map = nullptr;
+        ring_fd = -1;
+    }
+
+public:
+    // check ok(): setup fails on old kernels and where io_uring is disabled
+    explicit uring(unsigned entries) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ring_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if(ring_fd < 0) return;
+
+        sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if(single_mmap) sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+
+        sq_map = ::mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if(sq_map == MAP_FAILED) {
+            sq_map = nullptr;
+            destroy();
+            return;
+        }
+        cq_map = single_mmap ? sq_map
+            : ::mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if(cq_map == MAP_FAILED) {
+            cq_map = nullptr;
+            destroy();
+            return;
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        auto sqes_map = ::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if(sqes_map == MAP_FAILED) {
+            destroy();
+            return;
+        }
+        sqes = static_cast<io_uring_sqe*>(sqes_map);
+
+        sq_head = at<unsigned>(sq_map, params.sq_off.head);
+        sq_tail = at<unsigned>(sq_map, params.sq_off.tail);
+        sq_mask = at<unsigned>(sq_map, params.sq_off.ring_mask);
+        sq_array = at<unsigned>(sq_map, params.sq_off.array);
+        sq_entries = params.sq_entries;
+
+        cq_head = at<unsigned>(cq_map, params.cq_off.head);
+        cq_tail = at<unsigned>(cq_map, params.cq_off.tail);
+        cq_mask = at<unsigned>(cq_map, params.cq_off.ring_mask);
+        cqes = at<io_uring_cqe>(cq_map, params.cq_off.cqes);
+    }
+
+    uring(const uring&) = delete;
+
+    ~uring() { destroy(); }
+
+    // only valid with nothing in flight
+    void close() { destroy(); }
+
+    bool ok() const { return ring_fd >= 0; }
+
+    // queues one request filled in by prepare(sqe) and submits it; false if it could not be submitted
+    template<class F>
+    bool push(F prepare) {
+        auto tail = *sq_tail;
+        if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) return false;
+
+        auto index = tail & *sq_mask;
+        auto&& sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        prepare(sqe);
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        if(enter(1, 0, 0) == 1) return true;
+        // not consumed by the kernel: take it back so it is not submitted later
+        if(__atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == tail) {
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+            return false;
+        }
+        return true;
+    }
+
+    // queues and submits a positioned write; false if it could not be submitted
+    bool write(int fd, const char* data, size_t size, std::uint64_t offset, std::uint64_t user_data) {
+        return push([&](io_uring_sqe& sqe) {
+            sqe.opcode = IORING_OP_WRITE;
+            sqe.fd = fd;
+            sqe.addr = reinterpret_cast<std::uint64_t>(data);
+            sqe.len = static_cast<std::uint32_t>(std::min<size_t>(size, 1u << 30));
+            sqe.off = offset;
+            sqe.user_data = user_data;
+        });
+    }
+
+    // a request that completes at once, to wake a thread in wait()
+    bool nop(std::uint64_t user_data) {
+        return push([&](io_uring_sqe& sqe) {
+            sqe.opcode = IORING_OP_NOP;
+            sqe.user_data = user_data;
+        });
+    }
+
+    // blocks until at least one completion is available; false if the ring is unusable
+    bool wait() {
+        return enter(0, 1, IORING_ENTER_GETEVENTS) >= 0;
+    }
+
+    // calls on_complete(user_data, result) for every finished request
+    template<class F>
+    void reap(F on_complete) {
+        auto head = *cq_head;
+        for(;;) {
+            if(head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) break;
+            auto&& cqe = cqes[head & *cq_mask];
+            auto user_data = cqe.user_data;
+            auto res = cqe.res;
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            on_complete(user_data, res);
+        }
+    }
+};
+
+struct uring_stats {
+    size_t submitted = 0;
+    size_t completed = 0;
+    size_t in_flight = 0;
+    size_t max_in_flight = 0;
+    size_t full_waits = 0;        // flushes that waited for a free slot
+    size_t sync_writes = 0;       // writes done with pwrite(2) after a failed or rejected request
+    std::chrono::nanoseconds latency_total{ 0 }; // submission to completion, summed
+    std::chrono::nanoseconds latency_max{ 0 };
+};
+
+// A file_sink whose flushes are submitted to io_uring and complete asynchronously,
+// with up to queue_depth buffers in flight. Writes are positioned, so the file is
+// written at offsets tracked here instead of with O_APPEND. A thread per sink reaps
+// completions as they arrive, which frees their slots and timestamps them for
+// uring_stats. Behaves exactly like file_sink where io_uring cannot be set up.
+class uring_file_sink: public file_sink {
+    struct slot {
+        std::string data;
+        size_t done = 0;
+        std::uint64_t offset = 0;
+        std::chrono::steady_clock::time_point submitted;
+        bool busy = false;
+    };
+
+    // user_data of the request that wakes the reaper for shutdown
+    static constexpr std::uint64_t wake_reaper = ~std::uint64_t(0);
+
+    uring ring;
+    std::vector<slot> slots;
+    std::uint64_t offset = 0;
+    uring_stats ustats;
+    bool stopping = false;
+    // set once waiting on the ring has failed; it is only closed after the reaper stops
+    bool broken = false;
+    std::thread reaper;
+
+    // sink_mutex must be held; false once records are written with write(2) instead
+    bool active() const { return ring.ok() && not broken; }
+
+    static int drop_append(int fd) {
+        int flags = ::fcntl(fd, F_GETFL);
+        return flags < 0 ? -1 : ::fcntl(fd, F_SETFL, flags & ~O_APPEND);
+    }
+
+    // sink_mutex must be held
+    void write_at(const char* data, size_t size, std::uint64_t at) {
+        ++ustats.sync_writes;
+        while(size > 0) {
+            auto written = ::pwrite(fd, data, size, static_cast<off_t>(at));
+            if(written < 0) {
+                if(errno == EINTR) continue;
+                ++stats_.errors;
+                return;
+            }
+            ++stats_.writes;
+            stats_.bytes += static_cast<size_t>(written);
+            data += written;
+            size -= static_cast<size_t>(written);
+            at += static_cast<std::uint64_t>(written);
+        }
+    }
+
+    // sink_mutex must be held
+    void submit(size_t index) {
+        auto&& s = slots[index];
+        if(ring.write(fd, s.data.data() + s.done, s.data.size() - s.done, s.offset + s.done, index)) {
+            ++ustats.submitted;
+            return;
+        }
+        write_at(s.data.data() + s.done, s.data.size() - s.done, s.offset + s.done);
+        finish(index);
+    }
+
+    // sink_mutex must be held
+    void finish(size_t index) {
+        auto&& s = slots[index];
+        auto latency = std::chrono::steady_clock::now() - s.submitted;
+        ustats.latency_total += latency;
+        ustats.latency_max = std::max<std::chrono::nanoseconds>(ustats.latency_max, latency);
+        s.busy = false;
+        --ustats.in_flight;
+    }
+
+    // sink_mutex must be held
+    void complete(std::uint64_t index, std::int32_t res) {
+        // after abandon_ring() every slot has been written synchronously
+        if(index == wake_reaper || broken) return;
+        auto&& s = slots[index];
+        ++ustats.completed;
+        if(res <= 0) {
+            // e.g. a kernel without IORING_OP_WRITE; the data is still written, synchronously
+            write_at(s.data.data() + s.done, s.data.size() - s.done, s.offset + s.done);
+            finish(index);
+            return;
+        }
+        ++stats_.writes;
+        stats_.bytes += static_cast<size_t>(res);
+        s.done += static_cast<size_t>(res);
+        if(s.done < s.data.size()) submit(index);
+        else finish(index);
+    }
+
+    // sink_mutex must be held
+    void reap() {
+        ring.reap([this](std::uint64_t index, std::int32_t res) { complete(index, res); });
+    }
+
+    // runs on the reaper thread
+    void reap_completions() {
+        for(;;) {
+            bool ok = ring.wait();
+            std::lock_guard<std::mutex> lock(sink_mutex);
+            reap();
+            if(stopping || not ok) return;
+        }
+    }
+
+    // sink_mutex must be held. Waiting on the ring failed, so completions may never
+    // arrive: what is still in flight is written with pwrite(2), and from now on the
+    // sink writes like file_sink.
+    void abandon_ring() {
+        for(size_t i = 0; i < slots.size(); ++i) {
+            auto&& s = slots[i];
+            if(not s.busy) continue;
+            write_at(s.data.data() + s.done, s.data.size() - s.done, s.offset + s.done);
+            finish(i);
+        }
+        broken = true;
+        ++stats_.errors;
+        // write(2) appends again
+        int flags = ::fcntl(fd, F_GETFL);
+        if(flags < 0 || ::fcntl(fd, F_SETFL, flags | O_APPEND) != 0) ::lseek(fd, static_cast<off_t>(offset), SEEK_SET);
+    }
+
+    // sink_mutex must be held; slots.size() if every slot is in flight
+    size_t free_slot() const {
+        for(size_t i = 0; i < slots.size(); ++i) {
+            if(not slots[i].busy) return i;
+        }
+        return slots.size();
+    }
+
+    // sink_mutex must be held; slots.size() if the ring had to be abandoned
+    size_t acquire_slot() {
+        reap();
+        for(;;) {
+            auto index = free_slot();
+            if(index != slots.size()) return index;
+            ++ustats.full_waits;
+            if(not ring.wait()) {
+                abandon_ring();
+                return slots.size();
+            }
+            reap();
+        }
+    }
+
+    // sink_mutex must be held; data has been moved into the slot
+    void start(size_t index) {
+        auto&& s = slots[index];
+        s.done = 0;
+        s.offset = offset;
+        s.submitted = std::chrono::steady_clock::now();
+        s.busy = true;
+        offset += s.data.size();
+        ustats.max_in_flight = std::max(ustats.max_in_flight, ++ustats.in_flight);
+        submit(index);
+    }
+
+    void write_fully(const char* data, size_t size) override {
+        if(not active()) return file_sink::write_fully(data, size);
+        auto index = acquire_slot();
+        if(index == slots.size()) return file_sink::write_fully(data, size);
+        slots[index].data.assign(data, size);
+        start(index);
+    }
+
+    // sink_mutex must be held
+    void start_pending(size_t index) {
+        // the slot's old buffer becomes the new pending buffer, so neither reallocates
+        slots[index].data.clear();
+        std::swap(slots[index].data, pending);
+        start(index);
+    }
+
+    void flush_pending() override {
+        if(not active()) return file_sink::flush_pending();
+        if(pending.empty()) return;
+        auto index = acquire_slot();
+        if(index == slots.size()) return file_sink::flush_pending();
+        start_pending(index);
+    }
+
+    // sink_mutex must be held
+    void drain() {
+        reap();
+        while(ustats.in_flight > 0) {
+            if(not ring.wait()) return abandon_ring();
+            reap();
+        }
+    }
+
+public:
+    uring_file_sink(const std::string& filename, flush_policy policy = {}, unsigned queue_depth = 8):
+        file_sink(filename, mode::APPEND, policy),
+        ring(fd >= 0 ? std::max(queue_depth, 1u) : 0),
+        slots(std::max(queue_depth, 1u)) {
+        // the periodic_flusher may already call flush_if_due()
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(not ring.ok()) return;
+        off_t end = ::lseek(fd, 0, SEEK_END);
+        if(end < 0 || drop_append(fd) != 0) {
+            // positioned writes would not land at the end; stay with write(2)
+            ring.close();
+            return;
+        }
+        offset = static_cast<std::uint64_t>(end);
+        for(auto&& s : slots) s.data.reserve(policy.buffer_size);
+        reaper = std::thread([this]{ reap_completions(); });
+    }
+
+    virtual ~uring_file_sink() {
+        if(policy.interval.count() > 0) periodic_flusher::instance().remove(this);
+        {
+            std::lock_guard<std::mutex> lock(sink_mutex);
+            flush_pending();
+            if(active()) drain();
+            stopping = true;
+            // with nothing in flight the reaper sleeps in wait() until this completes
+            if(reaper.joinable()) ring.nop(wake_reaper);
+        }
+        if(reaper.joinable()) reaper.join();
+        ring.close();
+    }
+
+    // Runs on the periodic_flusher thread, which must not wait for this sink: a busy
+    // sink flushes on its own, and without a free slot the buffer waits for the next round.
+    void flush_if_due(std::chrono::steady_clock::time_point now) override {
+        std::unique_lock<std::mutex> lock(sink_mutex, std::try_to_lock);
+        if(not lock.owns_lock() || pending.empty() || now - pending_since < policy.interval) return;
+        if(not active()) {
+            ++stats_.interval_flushes;
+            return file_sink::flush_pending();
+        }
+        reap();
+        auto index = free_slot();
+        if(index == slots.size()) return;
+        ++stats_.interval_flushes;
+        start_pending(index);
+    }
+
+    // waits until everything flushed so far has been written
+    void sync() {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        flush_pending();
+        if(active()) drain();
+    }
+
+    // false if records are written with write(2) instead
+    bool uses_uring() {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        return active();
+    }
+
+    uring_stats queue_stats() {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        if(active()) reap();
+        return ustats;
+    }
+
+    // the policy and depth only apply to the first request for a given file
+    static std::shared_ptr<sink> instance(const std::string& filename, flush_policy policy = {}, unsigned queue_depth = 8) {
+        static std::unordered_map<std::string, std::shared_ptr<sink>> registry;
+        auto it = registry.find(filename);
+        if(it == registry.end()) {
+            return registry[filename] = std::make_shared<uring_file_sink>(filename, policy, queue_depth);
+        } else return it->second;
+    }
+};
+
+} /* namespace streamlogger */
+
+#endif // URING_SINK_H